@@ -18,7 +18,7 @@ type unary_op = Neg
 
 type image_op = Conv
 
-type var_type = Void | Bool | Int | UInt | Float | Matrix3x3 | Histogram | Image
+type var_type = Void | Bool | Int | UInt | Float | Matrix3x3 | Histogram | Image | ImageArray | Stream | Integral | Gray | FloatImage
 type var_decl = { vname : string; vtype : var_type }
 
 type expr =
@@ -48,6 +48,9 @@ type img_expr =
   | In of string * channel list * expr list
   | Imassign of string * img_expr
   | Imrange of string * int * int * int * int
+  | Imresize of string * expr * expr * string (* Source, width, height and sampling *)
+  | Imintegral of string                      (* Summed-area tables of the image *)
+  | Imfilter of string * string * expr list   (* Built-in filter and its arguments, "src ^ erode(3, 3)" *)
 
 type var_init =
     Iminit of var_decl * img_expr
@@ -64,11 +67,15 @@ type stmt =
   | Imexpr of img_expr
   | Imread of string * string
   | Imwrite of string * string
+  | Streamread of string * string  (* Next frame of the stream into the image *)
+  | Streamwrite of string * string (* Image appended to the stream *)
   | Return of expr
   | If of expr * stmt * stmt
   | For of expr * expr * expr * stmt
+  | Parfor of expr * expr * expr * stmt (* Iterations declared independent, run in parallel *)
   | While of expr * stmt
   | Break
+  | Located of int * stmt (* Statement with its source line *)
 
 type func_decl = {
     fname   : string;
@@ -76,16 +83,26 @@ type func_decl = {
     flocals : var_def list;
     fbody   : stmt list;
 	freturn : var_type;
-	fgpu    : bool
+	fgpu    : bool;
+	fline   : int
   }
 
 type program = var_def list * func_decl list
 
 (* 
    The below are some helper functions, some of them are used in the translate 
-   unit and other for testing 
+   unit and other for testing. The printers append to a Buffer so that large
+   programs are emitted in linear time, the string_of_* wrappers are for small
+   pieces only.
 *)
 
+(* Emit each element of l with f, separated by sep as String.concat would *)
+let add_list b sep f l =
+  ignore (List.fold_left (fun first x ->
+                            (if not first then Buffer.add_string b sep);
+                            f x;
+                            false) true l)
+
 let string_of_vartype = function
     Void -> "void"
   | Bool -> "bool"
@@ -95,38 +112,50 @@ let string_of_vartype = function
   | Matrix3x3 -> "float"
   | Histogram -> "Histogram"
   | Image -> "Image"
-
-let rec string_of_expr = function
-    BoolLiteral(l) -> string_of_bool l
-  | IntLiteral(l) -> string_of_int l
-  | FloatLiteral(l) -> string_of_float l
-  | StringLiteral(l) -> l
-  | Id(s) -> s
+  | ImageArray -> "ImageArray"
+  | Stream -> "Stream"
+  | Integral -> "Integral"
+  | Gray -> "Gray"
+  | FloatImage -> "FloatImage"
+
+let string_of_op = function
+    Add -> "+" | Sub -> "-" | Mult -> "*" | Div -> "/" | Mod -> "%"
+  | Neq -> "!=" | Lt -> "<" | Leq -> "<=" | Gt -> ">" | Geq -> ">=" | Eq -> "=="
+  | And -> "&&" | Or -> "||" | Not -> "!"
+  | BitAnd -> "&" | BitOr -> "|" | BitNot -> "~"
+
+let rec add_expr b e =
+  let add = Buffer.add_string b in
+  match e with
+    BoolLiteral(l) -> add (string_of_bool l)
+  | IntLiteral(l) -> add (string_of_int l)
+  | FloatLiteral(l) -> add (string_of_float l)
+  | StringLiteral(l) -> add l
+  | Id(s) -> add s
   | Unop(o, e) ->
-      (match o with
-	Neg -> "-") ^ string_of_expr e
+      add (match o with
+	Neg -> "-"); add_expr b e
   | Binop(e1, o, e2) ->
-      string_of_expr e1 ^ " " ^
-      (match o with
-	Add -> "+" | Sub -> "-" | Mult -> "*" | Div -> "/" | Mod -> "%"
-      | Neq -> "!=" | Lt -> "<" | Leq -> "<=" | Gt -> ">" | Geq -> ">=" | Eq -> "=="
-      | And -> "&&" | Or -> "||" | Not -> "!"
-      | BitAnd -> "&" | BitOr -> "|" | BitNot -> "~") ^ " " ^
-      string_of_expr e2
-  | Assign(v, e) -> v ^ " = " ^ string_of_expr e
+      add_expr b e1; add (" " ^ string_of_op o ^ " "); add_expr b e2
+  | Assign(v, e) -> add (v ^ " = "); add_expr b e
   | Call(f, el) ->
-      f ^ "(" ^ String.concat ", " (List.map string_of_expr el) ^ ")"
-  | Ques (e1, e2, e3) -> "(" ^ string_of_expr e1 ^ ") ? " ^
-      string_of_expr e2 ^ ":" ^ string_of_expr e3
-  | Bracket (e) -> "(" ^ string_of_expr e ^ ")"
-  | Imaccessor (i, r, c, a) -> i ^ "(" ^ string_of_expr r ^ "," ^ string_of_expr c ^ ")->" ^ a
-  | Accessor (i, a) -> i ^ "->" ^ a
-  | Noexpr -> ""
-
-let string_of_row3 = function
-    Row(e1, e2, e3) -> "{" ^ string_of_expr e1 ^ ", " 
-	                       ^ string_of_expr e2 ^ ", " 
-						   ^ string_of_expr e3 ^ "}"
+      add (f ^ "("); add_list b ", " (add_expr b) el; add ")"
+  | Ques (e1, e2, e3) -> add "("; add_expr b e1; add ") ? ";
+      add_expr b e2; add ":"; add_expr b e3
+  | Bracket (e) -> add "("; add_expr b e; add ")"
+  | Imaccessor (i, r, c, a) -> add (i ^ "("); add_expr b r; add ","; add_expr b c; add (")->" ^ a)
+  | Accessor (i, a) -> add (i ^ "->" ^ a)
+  | Noexpr -> ()
+
+let string_of_expr e =
+  let b = Buffer.create 64 in
+  add_expr b e; Buffer.contents b
+
+let add_row3 b = function
+    Row(e1, e2, e3) -> Buffer.add_string b "{"; add_expr b e1;
+                       Buffer.add_string b ", "; add_expr b e2;
+                       Buffer.add_string b ", "; add_expr b e3;
+                       Buffer.add_string b "}"
 
 let get_channel = function
     Channel(_, c) -> c
@@ -134,61 +163,76 @@ let get_channel = function
 let string_of_channel = function
     Channel(i, c) -> i ^ "(row, col)->" ^ String.capitalize c
 
-let string_of_channels c =
-  if ((List.length c) != 0)
-  then 
-    (string_of_channel (List.hd c) ^
-     String.concat "" (List.map (fun f -> ", " ^ string_of_channel f) (List.tl c)))
-  else ""
-
-let rec string_of_img_expr = function
-    Imop(s, o, k) -> "conv(" ^ s ^ "' " ^ k ^ ");\n";
-  | In (v, a, el) -> "in (" ^ string_of_channels a ^ ")\n{\n" ^ 
-      String.concat ";\n" (List.map string_of_expr el) ^ ";}\n"
-  | Imassign(v, e) -> v ^ " = " ^ string_of_img_expr e
-  | Imrange(v, x, y, w, h) -> v ^ "->range(" ^ string_of_int x ^ ", " ^
-                                  string_of_int y ^ ", " ^
-                                  string_of_int w ^ ", " ^
-                                  string_of_int h ^ ")"
+let add_channels b c =
+  add_list b ", " (fun f -> Buffer.add_string b (string_of_channel f)) c
+
+let rec add_img_expr b e =
+  let add = Buffer.add_string b in
+  match e with
+    Imop(s, o, k) -> add ("conv(" ^ s ^ "' " ^ k ^ ");\n")
+  | In (v, a, el) -> add "in ("; add_channels b a; add ")\n{\n";
+      add_list b ";\n" (add_expr b) el; add ";}\n"
+  | Imassign(v, e) -> add (v ^ " = "); add_img_expr b e
+  | Imrange(v, x, y, w, h) -> add (v ^ "->range(" ^ string_of_int x ^ ", " ^
+                                       string_of_int y ^ ", " ^
+                                       string_of_int w ^ ", " ^
+                                       string_of_int h ^ ")")
+  | Imresize(v, w, h, m) -> add ("resize(" ^ v ^ ", "); add_expr b w; add ", ";
+      add_expr b h; add (", " ^ m ^ ")")
+  | Imintegral(v) -> add ("integral(" ^ v ^ ")")
+  | Imfilter(s, f, el) -> add ("conv(" ^ s ^ "' " ^ f ^ "("); add_list b ", " (add_expr b) el; add "));\n"
 
 let string_of_vdecl var = (string_of_vartype var.vtype) ^ " " ^ var.vname
 
-let string_of_vinit = function
-    Iminit(v, e) -> string_of_vdecl v ^ " = " ^ string_of_img_expr e
-  | Vinit(v, e) -> string_of_vdecl v ^ " = " ^ string_of_expr e
-  | Immatrix3x3(v, r1, r2, r3) -> string_of_vdecl v ^ "[3][3] = " ^
-	                              "{" ^ string_of_row3 r1 ^ ", " 
-                                      ^ string_of_row3 r2 ^ ", " 
-							          ^ string_of_row3 r3 ^ "}"
-
-let string_of_vdef = function
-    VarDecl(v) -> string_of_vdecl v ^ ";\n"
-  | Varinit(vi) -> string_of_vinit vi ^ ";\n"
-
-let rec string_of_stmt = function
+let add_vinit b v =
+  let add = Buffer.add_string b in
+  match v with
+    Iminit(v, e) -> add (string_of_vdecl v ^ " = "); add_img_expr b e
+  | Vinit(v, e) -> add (string_of_vdecl v ^ " = "); add_expr b e
+  | Immatrix3x3(v, r1, r2, r3) -> add (string_of_vdecl v ^ "[3][3] = " ^ "{");
+                                  add_row3 b r1; add ", ";
+                                  add_row3 b r2; add ", ";
+                                  add_row3 b r3; add "}"
+
+let add_vdef b = function
+    VarDecl(v) -> Buffer.add_string b (string_of_vdecl v ^ ";\n")
+  | Varinit(vi) -> add_vinit b vi; Buffer.add_string b ";\n"
+
+let rec add_stmt b s =
+  let add = Buffer.add_string b in
+  match s with
     Block(stmts) ->
-      "{\n" ^ String.concat "" (List.map string_of_stmt stmts) ^ "}\n"
-  | Expr(expr) -> string_of_expr expr ^ ";\n";
-  | Imexpr(imexpr) -> string_of_img_expr imexpr
-  | Imread(i, p) -> i ^ " = imread(" ^ p ^ ");\n";
-  | Imwrite(i, p) -> i ^ " = imwrite(" ^ p ^ ");\n";  
-  | Return(expr) -> "return " ^ string_of_expr expr ^ ";\n";
-  | If(e, s, Block([])) -> "if (" ^ string_of_expr e ^ ")\n" ^ string_of_stmt s
-  | If(e, s1, s2) ->  "if (" ^ string_of_expr e ^ ")\n" ^
-      string_of_stmt s1 ^ "else\n" ^ string_of_stmt s2
+      add "{\n"; List.iter (add_stmt b) stmts; add "}\n"
+  | Expr(expr) -> add_expr b expr; add ";\n"
+  | Imexpr(imexpr) -> add_img_expr b imexpr
+  | Imread(i, p) -> add (i ^ " = imread(" ^ p ^ ");\n")
+  | Imwrite(i, p) -> add (i ^ " = imwrite(" ^ p ^ ");\n")
+  | Streamread(i, s) -> add (i ^ " = next(" ^ s ^ ");\n")
+  | Streamwrite(i, s) -> add (s ^ " = push(" ^ i ^ ");\n")
+  | Return(expr) -> add "return "; add_expr b expr; add ";\n"
+  | If(e, s, Block([])) -> add "if ("; add_expr b e; add ")\n"; add_stmt b s
+  | If(e, s1, s2) ->  add "if ("; add_expr b e; add ")\n";
+      add_stmt b s1; add "else\n"; add_stmt b s2
   | For(e1, e2, e3, s) ->
-      "for (" ^ string_of_expr e1  ^ " ; " ^ string_of_expr e2 ^ " ; " ^
-      string_of_expr e3  ^ ") " ^ string_of_stmt s
-  | While(e, s) -> "while (" ^ string_of_expr e ^ ") " ^ string_of_stmt s
-  | Break -> "break;\n"
-
-let string_of_fdecl fdecl =
-  (string_of_vartype fdecl.freturn) ^ " " ^
-  fdecl.fname ^ "(" ^ String.concat ", " (List.map string_of_vdecl fdecl.fparams) ^ ")\n{\n" ^
-  String.concat "" (List.map string_of_vdef fdecl.flocals) ^
-  String.concat "" (List.map string_of_stmt fdecl.fbody) ^
-  "}\n"
+      add "for ("; add_expr b e1; add " ; "; add_expr b e2; add " ; ";
+      add_expr b e3; add ") "; add_stmt b s
+  | Parfor(e1, e2, e3, s) ->
+      add "parfor ("; add_expr b e1; add " ; "; add_expr b e2; add " ; ";
+      add_expr b e3; add ") "; add_stmt b s
+  | While(e, s) -> add "while ("; add_expr b e; add ") "; add_stmt b s
+  | Break -> add "break;\n"
+  | Located(_, s) -> add_stmt b s
+
+let add_fdecl b fdecl =
+  let add = Buffer.add_string b in
+  add ((string_of_vartype fdecl.freturn) ^ " " ^ fdecl.fname ^ "(");
+  add_list b ", " (fun v -> add (string_of_vdecl v)) fdecl.fparams; add ")\n{\n";
+  List.iter (add_vdef b) fdecl.flocals;
+  List.iter (add_stmt b) fdecl.fbody;
+  add "}\n"
 
 let string_of_program (global_vars, funcs) =
-  String.concat "" (List.map string_of_vdef global_vars) ^ "\n" ^
-  String.concat "\n" (List.map string_of_fdecl funcs)
+  let b = Buffer.create 65536 in
+  List.iter (add_vdef b) global_vars; Buffer.add_string b "\n";
+  add_list b "\n" (add_fdecl b) funcs;
+  Buffer.contents b
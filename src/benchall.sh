@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Compile test programs with tracing and benchmark each one on synthetic images
+# through the "bench" target of the generated Makefile. The JSON lines are written
+# to bench.jsonl as well as the standard output.
+#
+# Usage: benchall.sh [.sip files]
+
+SIPC="./sip"
+
+results=bench.jsonl
+rm -f $results
+
+if [ $# -ge 1 ]
+then
+    files=$@
+else
+    files="tests/good/test-*.sip"
+fi
+
+for file in $files
+do
+    basename=`echo $file | sed 's/.*\\///
+                                s/.sip//'`
+
+    echo "###### Benchmarking $basename" 1>&2
+
+    $SIPC -c -profile $file || {
+        echo "FAILED $SIPC -c -profile $file" 1>&2
+        continue
+    }
+
+    (cd out && make -s bench) | tee -a $results
+done
@@ -0,0 +1,106 @@
+#!/bin/sh
+
+# Generate synthetic SIP programs of the given sizes in lines and time the translation
+# of each one with "sip -tcc" and "sip -tcl". Results are JSON lines written to
+# benchsip.jsonl as well as the standard output.
+#
+# Usage: benchsip.sh [line counts]
+
+SIPC="./sip"
+
+results=benchsip.jsonl
+rm -f $results
+
+workdir=benchsip.tmp
+mkdir -p $workdir
+
+if [ $# -ge 1 ]
+then
+    sizes=$@
+else
+    sizes="10000 50000 100000"
+fi
+
+# Generate <lines> <file>
+# A program with helper functions, a kernel with a long straight body and a main
+# function made of nested blocks of expressions, calls and image statements.
+Generate() {
+    awk -v lines=$1 'BEGIN {
+        funs = int(lines / 200) + 1
+        for (f = 0; f < funs; f++) {
+            print "fun f" f "(int a, int b) int"
+            print "{"
+            print "    int c;"
+            print "    c = a * b + " f ";"
+            print "    if (c > 100) { c = c - 1; } else { c = c + 1; }"
+            print "    for (a = 0; a < b; a = a + 1) { c = c + a % 7; }"
+            print "    return c;"
+            print "}"
+            print ""
+        }
+        n = funs * 9
+
+        print "kernel blur(image in_image, image out_image)"
+        print "{"
+        print "    float red_out;"
+        print "    float green_out;"
+        print "    float blue_out;"
+        print "    red_out = 0.0;"
+        print "    green_out = 0.0;"
+        print "    blue_out = 0.0;"
+        for (i = 0; i < lines / 10; i += 3) {
+            at = "in_image[" int(i / 3) % 3 - 1 "," int(i / 9) % 5 - 2 "]"
+            print "    red_out = red_out + " at "->Red / 9;"
+            print "    green_out = green_out + " at "->Green / 9;"
+            print "    blue_out = blue_out + " at "->Blue / 9;"
+        }
+        print "}"
+        print ""
+        n += int(lines / 10) + 10
+
+        print "fun main()"
+        print "{"
+        print "    image src;"
+        print "    image dst;"
+        print "    int v;"
+        print "    src << \"./blackbuck.bmp\";"
+        print "    v = 0;"
+        i = 0
+        while (n < lines - 10) {
+            print "    if (v >= 0)"
+            print "    {"
+            print "        v = f" (i % funs) "(v, " i % 13 ") + (v * 3 - 1) / 2;"
+            print "        dst = src ^ blur;"
+            print "        dst = src in (red, green, blue) for { red: (red > 128) ? 255 : 0, green: green / 2, blue: blue };"
+            print "        while (v > 1000) { v = v - 1000; }"
+            print "    }"
+            n += 7
+            i++
+        }
+        print "    writeln(v);"
+        print "    dst >> \"./benchsip.bmp\";"
+        print "}"
+    }' > $2
+}
+
+for size in $sizes
+do
+    file=$workdir/benchsip-$size.sip
+    Generate $size $file
+    lines=`wc -l < $file`
+
+    for target in tcc tcl
+    do
+        echo "###### Translating $file with -$target" 1>&2
+        start=`date +%s%N`
+        $SIPC -$target $file > $workdir/benchsip-$size.$target.out || {
+            echo "FAILED $SIPC -$target $file" 1>&2
+            continue
+        }
+        end=`date +%s%N`
+        ms=`expr \( $end - $start \) / 1000000`
+        echo "{\"lines\":$lines,\"target\":\"$target\",\"wall_ms\":$ms}" | tee -a $results
+    done
+done
+
+rm -rf $workdir
@@ -22,8 +22,8 @@ let string_of_makefile t =
   "TARGET = " ^ t ^ ".out\n" ^
   "OBJS = " ^ t ^ ".o sip.o EasyBMP.o\n" ^
   "CC = g++\n" ^
-  "CFLAGS = -Wall -O3\n" ^
-  "LFLAGS = -Wall\n\n" ^
+  "CFLAGS = -Wall -O3 -std=c++11 -pthread\n" ^
+  "LFLAGS = -Wall -pthread\n\n" ^
   "ifeq ($(SHELLNAME), Darwin)\n" ^
   "\tLIBS = -framework OpenCL\n" ^
   "else\n" ^
@@ -37,10 +37,15 @@ let string_of_makefile t =
   "\tg++ $(CFLAGS) -c sip.cpp\n\n" ^
   "EasyBMP.o: EasyBMP.cpp EasyBMP*.h\n" ^
   "\tg++ $(CFLAGS) -c EasyBMP.cpp\n\n" ^
+  "genbmp: genbmp.cpp\n" ^
+  "\tg++ $(CFLAGS) genbmp.cpp -o genbmp\n\n" ^
+  "bench: $(TARGET) genbmp\n" ^
+  "\tsh ./bench.sh ./$(TARGET) " ^ t ^ "\n\n" ^
   "clean:\n" ^
   "\trm *.o\n\n" ^
   "cleanall:\n" ^
-  "\trm *.o $(TARGET)\n"
+  "\trm *.o $(TARGET)\n\n" ^
+  ".PHONY: bench clean cleanall\n"
 
 let gen_makefile t =
   let mf = string_of_makefile t in
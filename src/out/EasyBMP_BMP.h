@@ -67,6 +67,7 @@ class BMP
  BMP();
  BMP( BMP& Input );
  ~BMP();
+ void Swap( BMP& Other );
  RGBApixel* operator()(int i,int j);
  
  RGBApixel GetPixel( int i, int j ) const;
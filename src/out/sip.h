@@ -11,8 +11,35 @@
 */
 
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <strings.h>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -30,9 +57,79 @@ using namespace std;
 #define MEM_SIZE (128)
 #define MAX_SOURCE_SIZE (0x100000)
 
+// Work-group sizes picked by the tuner are kept in this file, SIP_TUNING_DB overrides it
+// and SIP_TUNING=0 falls back to the driver default.
+#define TUNING_DB_FILE "./sip_tuning.db"
+#define TUNING_RUNS (2)
+
+// Images shorter than this many rows per device aren't worth splitting.
+#define MIN_BAND_ROWS (64)
+
+// Images whose path ends in ".raw" are kept in the layout they have in memory: a header,
+// then the BGRA pixels of each column from the top row down, each column starting on a
+// RAW_ALIGN boundary. Reading maps the file and copies the columns, with no decoding.
+#define RAW_MAGIC "SIPRAW1"
+#define RAW_ALIGN (64)
+
+// Threads running file reads and writes in the background: the reads that Image::prefetch
+// starts at program start and the writes of "img >> path".
+#define IO_THREADS (4)
+
+// Frames a "stream" decodes ahead of the one being processed, SIP_PREFETCH overrides it. The
+// writer holds as many frames waiting to be encoded before "img >> stream" blocks.
+#define STREAM_DEPTH (4)
+
+// Spans kept by the tracer of "sip -c -profile" programs, later ones are counted and dropped.
+#define MAX_TRACE_EVENTS (1000000)
+
 namespace Sip
 {
 	class Image;
+	class Gray;
+	class FloatImage;
+	class ImageArray;
+	class Integral;
+
+    // One OpenCL device with its own context, queue and program.
+    struct ClDevice
+    {
+        cl_platform_id   platformId;
+        cl_device_id     deviceId;
+        cl_context       context;
+        cl_command_queue commandQueue;
+        cl_program       program;
+        string           name;
+        double           throughput; // Pixels per second, sizes the device's share of a launch
+        bool             measured;
+    };
+
+    // Rows and columns around each pixel read by a kernel, from the "sip:stencil" metadata.
+    struct Stencil
+    {
+        int rowMin;
+        int rowMax;
+        int colMin;
+        int colMax;
+    };
+
+    // Times of the RunKernel/ApplyFilter calls issued by one SIP statement, in seconds.
+    struct KernelProfile
+    {
+        KernelProfile() : line(0), launches(0), pixels(0.0), pack(0.0), write(0.0),
+                          run(0.0), read(0.0), unpack(0.0), wait(0.0)
+        {}
+
+        int      line;
+        string   kernel;
+        unsigned launches;
+        double   pixels;
+        double   pack;   // Host copy of the image into the staging buffer
+        double   write;
+        double   run;
+        double   read;
+        double   unpack; // Host copy of the staging buffer into the image
+        double   wait;   // Queued to start, summed over the commands
+    };
 
     class ClProgram
     {
@@ -41,26 +138,106 @@ namespace Sip
         ~ClProgram();
 
         void CompileClFile(const char* filename);
-        void RunKernel(Image& in_image, Image& out_image, const char* kernelName);
-        void ApplyFilter(Image& in_image, Image& out_image, float* filter);
+        void RunKernel(Image& in_image, Image& out_image, const char* kernelName, int line = 0);
+        void ApplyFilter(Image& in_image, Image& out_image, float* filter, int line = 0);
+
+        // Batches run as a single launch, the output array is resized to the input one.
+        void RunKernel(ImageArray& in_images, ImageArray& out_images, const char* kernelName, int line = 0);
+        void ApplyFilter(ImageArray& in_images, ImageArray& out_images, float* filter, int line = 0);
+
+        // Gray images are staged as RGBA with the value in the three colors, the result is
+        // the luma of the kernel's output.
+        void RunKernel(Gray& in_image, Gray& out_image, const char* kernelName, int line = 0);
+        void ApplyFilter(Gray& in_image, Gray& out_image, float* filter, int line = 0);
+
+        // Float images are CL_FLOAT device images, uploaded from and read back into their pixels.
+        void RunKernel(FloatImage& in_image, FloatImage& out_image, const char* kernelName, int line = 0);
+        void ApplyFilter(FloatImage& in_image, FloatImage& out_image, float* filter, int line = 0);
 
     private:
+        // Bands of one launch still running, counted down by their event callbacks.
+        struct Pending
+        {
+            mutex              lock;
+            condition_variable done;
+            size_t             count;
+            double             start;
+        };
+
+        // Output rows [first, last) computed by one device from the input rows [top, bottom).
+        struct Band
+        {
+            size_t    device;
+            size_t    first;
+            size_t    last;
+            size_t    top;
+            size_t    bottom;
+            cl_mem    imageSrc;
+            cl_mem    imageDst;
+            cl_mem    imageFilter;
+            cl_kernel kernel;
+            cl_event  events[4];
+            cl_uint   eventCount;
+            Pending*  pending;
+            double    elapsed;  // Seconds from the launch until the band finished
+            bool      done;
+        };
+
         void Init();
         void Uninit();
+        bool InitDevice(cl_platform_id platformId, cl_device_id deviceId);
+        void ParseStencils(const char* source);
+
+        void Execute(Image& in_image, Image& out_image, const char* kernelName, float* filter, int line);
+        void Execute(Gray& in_image, Gray& out_image, const char* kernelName, float* filter, int line);
+        void Execute(FloatImage& in_image, FloatImage& out_image, const char* kernelName, float* filter, int line);
+        void ExecuteBatch(ImageArray& in_images, ImageArray& out_images, const char* kernelName,
+                          float* filter, int line);
+        void Dispatch(size_t width, size_t height, cl_channel_type type, const function<void(char*)>& packInput,
+                      const function<void(const char*)>& unpackOutput, const char* kernelName,
+                      float* filter, int line, const string& inName, const string& outName,
+                      const char* source = NULL, char* target = NULL);
+        void Split(const char* kernelName, size_t height, vector<Band>& bands);
+        bool EnqueueBand(Band& band, const char* kernelName, float* filter, cl_channel_type type,
+                         const char* input, char* output, size_t width);
+        void ReleaseBand(Band& band);
+        static void CL_CALLBACK Finished(cl_event event, cl_int status, void* data);
+
+        cl_int Launch(ClDevice& device, cl_kernel kernel, const char* kernelName, size_t width, size_t height,
+                      cl_uint waitCount, const cl_event* waitList, cl_event* event);
+        void Tune(ClDevice& device, cl_kernel kernel, const string& key, size_t width, size_t height,
+                  cl_uint waitCount, const cl_event* waitList);
+        string TuningKey(ClDevice& device, const char* kernelName, size_t width, size_t height);
+        void LoadTuning();
+        void SaveTuning(const string& key);
+
+        void Profile(int line, const char* kernelName, size_t pixels, double pack, double unpack,
+                     vector<Band>& bands);
+        void Report();
 
     private:
-        cl_command_queue _commandQueue;
-        cl_device_id     _deviceId;
-        cl_context       _context;
-        cl_program       _program;
-        cl_platform_id   _platformId;
+        vector<ClDevice>     _devices;
+        map<string, Stencil> _stencils;
+
+        // Tuned local work size per device, kernel and image size class, {0, 0} is the driver default.
+        bool             _tuning;
+        bool             _tuningLoaded;
+        map<string, pair<size_t, size_t> > _localSizes;
+
+        bool                        _profiling;
+        map<string, KernelProfile>  _profiles;
+
+        // Held by the launches of concurrent parfor iterations while they use the devices.
+        mutex _lock;
     };
 
     class Image
     {
     public:
 		Image();
+		Image(const char* name);
 		Image(const Image& img);
+		~Image();
 
         int width();
         int height();
@@ -71,15 +248,419 @@ namespace Sip
 		                 unsigned int width,
 		                 unsigned int height,
 		                 Image& img);
+
+        enum Sampling { Nearest = 0, Bilinear, Area };
+
+        // Scale the image to width x height into img, "resize(src, w, h, bilinear)" in SIP.
+        // Always runs on the CPU, it doesn't use the OpenCL devices.
+        void resizeTo(int width, int height, Sampling mode, Image& img);
+
+        enum Morphology { Erode = 0, Dilate, Open, Close };
+
+        // Morphology with a width x height rectangle into img, "src ^ erode(5, 5)" in SIP.
+        // Erode, dilate, open and close always run on the CPU, not on the OpenCL devices.
+        void morphology(Morphology op, int width, int height, Image& img);
+
+        // Median of each channel over the (2 radius + 1) square into img, "src ^ median(2)" in SIP.
+        void median(int radius, Image& img);
+
+        // Gaussian blur of standard deviation sigma into img, "src ^ gaussian(4.0)" in SIP.
+        void gaussian(float sigma, Image& img);
 		
-        RGBApixel* operator()(int i,int j);
+        RGBApixel* operator()(int row, int col);
         Image& operator=(Image &rhs);
+        Image& operator=(Gray &rhs); // The gray value in the three colors
+        Image& operator=(FloatImage &rhs); // Scaled by 255, rounded and clamped
+
+        // Paths ending in ".ppm" or ".pgm" are binary netpbm files (P6 and P5), read and written
+        // in one block. ".pgm" files hold the luma of the image. Uncompressed 1, 4, 8, 24 and
+        // 32 bit BMPs are read from a mapping of the file, blocks of rows being decoded on the
+        // thread pool, EasyBMP reads the other BMPs.
+        void read(const char* path);
+        bool write(const char* path); // False if the file couldn't be written
+
+        // Starts reading path on the I/O threads, the next read of path waits for it and takes
+        // its pixels. Writing path drops it, so that reads see the file as written.
+        static void prefetch(const char* path);
+
+        // Writes a copy of the image to path on the I/O threads, "img >> path" in SIP. The
+        // saves of a path are written in order, and reading or writing it waits for them.
+        void save(const char* path);
+
+        // Waits for every save, of any type of image, and prints the paths that couldn't be
+        // written. Returns 1 if there were any, main returns it.
+        static int flush();
+
+        const string& name();
+
+        enum Channel { Red = 0, Green, Blue, Alpha };
+
+        // Image-wide reductions of one channel, "sum(img->Red)" in SIP.
+        double sum(Channel channel);
+        double min(Channel channel);
+        double max(Channel channel);
+        double mean(Channel channel);
+        double stddev(Channel channel);
+
+    private:
+        // Partial results of a reduction over a block of columns.
+        struct Moments
+        {
+            uint64_t sum;
+            uint64_t squares;
+            unsigned min;
+            unsigned max;
+        };
+
+        void Account();
+        void Load(const char* path);
+        void Swap(Image& img);
+        bool ReadBmp(const char* path);
+        bool ReadRaw(const char* path);
+        bool WriteRaw(const char* path);
+        bool ReadNetpbm(const char* path);
+        bool WriteNetpbm(const char* path, bool gray);
+        Moments Reduce(Channel channel);
+
+    private:
+        BMP    _image;
+        string _name;  // SIP variable, the memory counters are kept per name
+        size_t _bytes; // Pixel bytes reported to the counters
+    };
+
+    // Pixel of a gray image, "img[row, col]->Luma" in SIP.
+    struct GrayPixel
+    {
+        ebmpBYTE Luma;
+    };
+
+    // The "gray" type: one byte per pixel. The pixels are stored column by column as in a
+    // BMP, so the filters of Image run on either. Assigning an image keeps its luma, and
+    // ".bmp" files are written with 8 bits per pixel and a gray palette.
+    class Gray
+    {
+    public:
+        Gray();
+        Gray(const char* name);
+        Gray(const Gray& img);
+        ~Gray();
+
+        int width();
+        int height();
+
+        void clone(Gray& img);
+
+        // The filters of Image, on the gray value.
+        void morphology(Image::Morphology op, int width, int height, Gray& img);
+        void median(int radius, Gray& img);
+        void gaussian(float sigma, Gray& img);
+
+        GrayPixel* operator()(int row, int col);
+        Gray& operator=(Gray &rhs);
+        Gray& operator=(Image &rhs); // (77 red + 150 green + 29 blue) / 256
+
+        void read(const char* path);
+        bool write(const char* path);
+        void save(const char* path); // As Image::save
+
+        const string& name();
+
+    private:
+        void SetSize(int width, int height);
+        bool ReadPgm(const char* path);
+        bool WritePgm(const char* path);
+        bool WriteBmp(const char* path);
+
+    private:
+        string           _name; // SIP variable, the memory counters are kept per name
+        int              _width;
+        int              _height;
+        vector<ebmpBYTE> _pixels;
+    };
+
+    // Pixel of a float image, in the order of a CL_RGBA float4.
+    struct FloatPixel
+    {
+        float Red;
+        float Green;
+        float Blue;
+        float Alpha;
+    };
+
+    // The "fimage" type: four floats per pixel, 0 to 1 spanning the range of an 8 bit
+    // channel as kernels read it, and nothing is clamped. The pixels are stored row by row
+    // as in a CL_FLOAT image so kernels use them in place, and they are quantized to 8 bits
+    // only when written to a file or assigned to an image.
+    class FloatImage
+    {
+    public:
+        FloatImage();
+        FloatImage(const char* name);
+        FloatImage(const FloatImage& img);
+        ~FloatImage();
+
+        int width();
+        int height();
+
+        void clone(FloatImage& img);
+
+        FloatPixel* operator()(int row, int col);
+        FloatImage& operator=(FloatImage &rhs);
+        FloatImage& operator=(Image &rhs); // Divided by 255
+
+        void read(const char* path);
+        bool write(const char* path);
+        void save(const char* path); // As Image::save, quantized on the I/O threads
+
+        const string& name();
+
+    private:
+        void SetSize(int width, int height);
+
+    private:
+        string             _name; // SIP variable, the memory counters are kept per name
+        int                _width;
+        int                _height;
+        vector<FloatPixel> _pixels;
+    };
+
+    // The "image[]" type: a batch of images read from a file list or a wildcard path and
+    // written to numbered files. All the images share the array's name for the memory counters.
+    class ImageArray
+    {
+    public:
+        ImageArray(const char* name);
+        ~ImageArray();
+
+        int size();
+        void resize(int count);
+        Image& operator[](int i);
+        ImageArray& operator=(ImageArray& rhs);
+        const string& name();
 
         void read(const char* path);
-        void write(const char* path);
+        void write(const char* pattern);
+        void save(const char* pattern); // Image::save of each image
+
+    private:
+        ImageArray(const ImageArray&);
+
+    private:
+        string         _name;
+        vector<Image*> _images;
+    };
+
+    // The "integral" type: summed-area tables of the red, green and blue channels and of
+    // their squares, built by "table = integral(img);". A box query reads four entries of
+    // a table whatever the size of the window.
+    // Tables are always built and queried on the CPU, not on the OpenCL devices.
+    class Integral
+    {
+    public:
+        Integral(const char* name);
+        ~Integral();
+
+        void build(Image& img);
+        int width();
+        int height();
+        const string& name();
+
+        // Window of the given radius around (row, col), clipped to the image.
+        double boxsum(Image::Channel channel, int row, int col, int radius);
+        double boxmean(Image::Channel channel, int row, int col, int radius);
+        double boxvar(Image::Channel channel, int row, int col, int radius);
+
+    private:
+        Integral(const Integral&);
+
+        // Sums over the window, and the number of pixels in it once clipped.
+        double Window(const vector<uint64_t>& table, int row, int col, int radius, double& count);
+
+    private:
+        string           _name;
+        int              _width;
+        int              _height;
+        size_t           _bytes;
+        vector<uint64_t> _sums[3];    // (height + 1) x (width + 1), row major, per channel
+        vector<uint64_t> _squares[3];
+    };
+
+    // The "stream" type: a numbered image sequence ("./frame_%05d.bmp") or the images of a
+    // directory, read in order while a thread decodes the next frames, and written in order
+    // while a thread encodes the previous ones.
+    class Stream
+    {
+    public:
+        Stream(const char* name);
+        ~Stream();
+
+        bool more();
+        void next(Image& img);
+        void push(Image& img);
+        void close();
+        const string& name();
+
+        void read(const char* source);
+        void write(const char* pattern);
+
+    private:
+        Stream(const Stream&);
+
+        void ReadAhead();
+        void WriteBehind();
 
     private:
-        BMP _image;
+        string             _name;
+        size_t             _depth;
+        vector<string>     _files;   // Input frames, in order
+        string             _pattern; // Output frames, formatted with their index
+        deque<Image*>      _decoded; // Read and not taken yet
+        deque<Image*>      _pending; // Pushed and not written yet
+        bool               _reading;
+        bool               _writing;
+        bool               _stop;
+        thread             _reader;
+        thread             _writer;
+        mutex              _lock;
+        condition_variable _changed;
+    };
+
+    // Live and peak bytes held by the images, per SIP variable and in total. Host is the
+    // pixels of the images, Staging the packed copies made for a launch and Device the
+    // OpenCL memory objects.
+    class Memory
+    {
+    public:
+        enum Kind { Host = 0, Staging, Device, KindCount };
+
+        static void Allocate(Kind kind, const string& owner, size_t bytes);
+        static void Release(Kind kind, const string& owner, size_t bytes);
+
+    private:
+        struct Usage
+        {
+            Usage();
+
+            size_t live[KindCount];
+            size_t peak[KindCount];
+            size_t liveTotal;
+            size_t peakTotal;
+        };
+
+        struct State
+        {
+            State();
+
+            mutex               lock;
+            bool                reporting;
+            bool                registered;
+            Usage               total;
+            map<string, Usage>  owners;
+            map<string, size_t> atPeak; // Live bytes of each owner when the total peaked
+        };
+
+        // Images are constructed before main in other files, so the counters live in a
+        // function static rather than in static members.
+        static State& Get();
+        static void Line(const char* name, const Usage& u);
+        static void Report();
+    };
+
+    // Chrome trace-event recorder, the compiler opens it at the start of main when
+    // compiling with "sip -c -profile" and the trace is written at exit. SIP_TRACE_FILE
+    // overrides the path given by the compiler.
+    class Tracer
+    {
+    public:
+        static void Open(const char* path);
+        static void Record(const char* name, int line, double start, double end);
+        static double Now();
+
+    private:
+        struct Event
+        {
+            const char* name;
+            int         line;
+            double      start;
+            double      end;
+            long        maxRss; // Peak resident size of the process so far, in KB
+            int         thread; // Numbered from 1 in the order threads record their first span
+        };
+
+        static void Write();
+
+        static mutex         _lock;
+        static atomic<int>   _threads;
+        static bool          _open;
+        static string        _path;
+        static double        _origin;
+        static vector<Event> _events;
+        static size_t        _dropped;
+    };
+
+    // Records the lifetime of a scope as one span of the trace.
+    class TraceScope
+    {
+    public:
+        TraceScope(const char* name, int line);
+        ~TraceScope();
+
+    private:
+        const char* _name;
+        int         _line;
+        double      _start;
+    };
+
+    // Runs the iterations of "parfor" loops on a pool of worker threads, the calling thread
+    // being one of them. Each worker takes iterations from the front of its own contiguous
+    // range and, once it is empty, steals the back half of the fullest other range. A parfor
+    // nested in another one runs on the thread that reaches it, as does one started while the
+    // pool is busy, e.g. by a read on an I/O thread.
+    class ThreadPool
+    {
+    public:
+        static void ParallelFor(size_t count, const function<void(size_t)>& body);
+
+        // Runs the task on one of the IO_THREADS threads, in the order submitted. They are
+        // started by the first task, and the tasks still queued at exit are dropped.
+        static void Background(const function<void()>& task);
+
+    private:
+        struct Range
+        {
+            mutex  lock;
+            size_t begin;
+            size_t end;
+        };
+
+        ThreadPool();
+        ~ThreadPool();
+
+        static ThreadPool& Get();
+        void Run(size_t count, const function<void(size_t)>& body);
+        void Work(size_t worker);
+        void Drain(size_t worker);
+        bool Next(size_t worker, size_t& index);
+        void Serve();
+
+    private:
+        vector<thread> _threads;
+        vector<Range*> _ranges; // One per worker, the calling thread is worker 0
+
+        mutex                          _submit; // One parfor at a time
+        mutex                          _lock;
+        condition_variable             _start;
+        condition_variable             _done;
+        const function<void(size_t)>*  _body;
+        size_t                         _generation;
+        size_t                         _running;
+        bool                           _stop;
+
+        vector<thread>                 _io;
+        deque<function<void()> >       _tasks; // Waiting for an I/O thread
+        mutex                          _ioLock;
+        condition_variable             _queued;
+        bool                           _ioStop;
     };
 
     class Histogram
@@ -87,6 +668,7 @@ namespace Sip
 	public:
 		Histogram();
 		Histogram(Image& img);
+		Histogram(Gray& img); // The same counts in the three colors
 		
 		unsigned int operator()(int bin, int color);
         		
@@ -16,6 +16,9 @@ type action = Ast | Compile | TestCpp | TestOpenCL | Error
 
 let out_name = ref "a"
 
+(* Index in argv of the source file, after the action and its options *)
+let src_arg = ref 2
+
 (* Helper function that write "content" into a file named "name" *)
 let fwrite name content =
     let out = open_out name in
@@ -37,6 +40,7 @@ let usage_string =
     right_string ^ 
     "Usage:\n\n" ^
     "    Compiling to C++ and OpenCL  : sip -c <filename>\n" ^
+    "    Compiling with tracing       : sip -c -profile <filename>\n" ^
     "    Compiling to AST Tree        : sip -a <filename>\n" ^
     "    Compiling to C++ to stdin    : sip -tcc <filename>\n" ^
     "    Compiling to OpenCL to stdin : sip -tcl <filename>\n"
@@ -52,8 +56,10 @@ let main () =
       with
 	    _ -> Error
     else Error in
-        let lexbuf = ignore(out_name := get_filename Sys.argv.(2)); 
-                     Lexing.from_channel (open_in Sys.argv.(2)) in
+        let _ = if ((Array.length Sys.argv > 3) && ((String.compare Sys.argv.(2) "-profile") == 0))
+                then (Translate.profile := true; src_arg := 3) in
+        let lexbuf = ignore(out_name := get_filename Sys.argv.(!src_arg)); 
+                     Lexing.from_channel (open_in Sys.argv.(!src_arg)) in
         let program = Parser.program Scanner.token lexbuf in
         match action with
           Ast -> let listing = Ast.string_of_program program in
@@ -12,9 +12,27 @@ globalerror=0
 
 keep=0
 
+# Run mode: build and run the generated programs that have a reference output, see Output below
+run=0
+
+# Performance mode: build and time the generated programs, see Perf below
+perf=0
+runs=5
+threshold=20
+slack=5
+rebase=0
+baseline=tests/perf.baseline
+perflog=perf.log
+rm -f $perflog
+
 Usage() {
     echo "Usage: testall.sh [options] [.sip files]"
     echo "-k    Keep intermediate files"
+    echo "-r    Build and run the programs with a .runout.txt and compare what they print"
+    echo "-p    Build and time the generated programs against the baseline"
+    echo "-n N  Number of timed runs per program with -p (default 5)"
+    echo "-t P  Allowed slowdown in percent of the baseline median (default 20)"
+    echo "-b    Record the measured medians as the new baseline (implies -p)"
     echo "-h    Print this help"
     exit 1
 }
@@ -48,6 +66,62 @@ Run() {
     }
 }
 
+# Output <sipfile> <basename> <reffile>
+# Builds the generated program in out/, runs it once and compares what it prints with
+# reffile.runout.txt. The "Error: " lines of a machine without an OpenCL device are left
+# out, the programs with a reference output don't need one.
+Output() {
+    generatedfiles="$generatedfiles ${2}.run.out" &&
+    Run "$SIPC" "-c" $1 &&
+    Run "(cd out && make -s > /dev/null)" &&
+    Run "(cd out && ./$2.out)" "|" "grep -v '^Error: '" ">" ${2}.run.out
+    Compare ${2}.run.out ${3}.runout.txt ${2}.run.diff
+}
+
+# Perf <sipfile> <basename>
+# Builds the generated program in out/, runs it $runs times on the corpus
+# image and compares the median wall time with the baseline. A regression
+# must exceed both $threshold percent and $slack ms to count, so that the
+# short programs do not fail on timer noise.
+Perf() {
+    Run "$SIPC" "-c" $1 &&
+    Run "(cd out && make -s > /dev/null)" || return 1
+
+    times=""
+    i=0
+    while [ $i -lt $runs ] ; do
+	start=`date +%s%N`
+	Run "(cd out && ./$2.out > /dev/null)" || return 1
+	end=`date +%s%N`
+	times="$times `expr \( $end - $start \) / 1000000`"
+	i=`expr $i + 1`
+    done
+
+    median=`echo $times | tr ' ' '\n' | sort -n | awk '{ t[NR] = $1 }
+        END { if (NR % 2) print t[(NR + 1) / 2]; else print int((t[NR / 2] + t[NR / 2 + 1]) / 2) }'`
+    echo "$2 $median" >> $perflog
+    echo "median of $runs runs:$times -> ${median}ms" 1>&2
+    echo -n "${median}ms "
+
+    base=""
+    if [ -f $baseline ] ; then
+	base=`awk -v n=$2 '$1 == n { print $2 }' $baseline`
+    fi
+    if [ -z "$base" ] ; then
+	echo "no baseline for $2" 1>&2
+	return 0
+    fi
+
+    limit=`expr $base \* \( 100 + $threshold \) / 100`
+    if [ `expr $base + $slack` -gt $limit ] ; then
+	limit=`expr $base + $slack`
+    fi
+    if [ $median -gt $limit ] ; then
+	SignalError "$2 took ${median}ms, baseline ${base}ms, limit ${limit}ms"
+	echo "FAILED $2 regressed to ${median}ms from ${base}ms" 1>&2
+    fi
+}
+
 Check() {
     error=0
     basename=`echo $1 | sed 's/.*\\///
@@ -70,6 +144,14 @@ Check() {
     Run "$SIPC" "-tcl" $1 ">" ${basename}.cl.out &&
     Compare ${basename}.cl.out ${reffile}.clout.cl ${basename}.cl.diff
 
+    if [ $run -eq 1 ] && [ -f ${reffile}.runout.txt ] ; then
+	Output $1 $basename $reffile
+    fi
+
+    if [ $perf -eq 1 ] ; then
+	Perf $1 $basename
+    fi
+
     # Report the status and clean up the generated files
 
     if [ $error -eq 0 ] ; then
@@ -84,11 +166,27 @@ Check() {
     fi
 }
 
-while getopts kdpsh c; do
+while getopts kdrpsbn:t:h c; do
     case $c in
 	k) # Keep intermediate files
 	    keep=1
 	    ;;
+	r) # Run the generated programs
+	    run=1
+	    ;;
+	p) # Time the generated programs
+	    perf=1
+	    ;;
+	b) # Rewrite the baseline with this run
+	    perf=1
+	    rebase=1
+	    ;;
+	n) # Timed runs per program
+	    runs=$OPTARG
+	    ;;
+	t) # Threshold in percent
+	    threshold=$OPTARG
+	    ;;
 	h) # Help
 	    Usage
 	    ;;
@@ -120,4 +218,16 @@ do
     esac
 done
 
+# Merge the new medians into the baseline, keeping programs not run this time
+
+if [ $rebase -eq 1 ] && [ -f $perflog ] ; then
+    {
+	if [ -f $baseline ] ; then
+	    awk 'NR == FNR { seen[$1] = 1; next } !($1 in seen)' $perflog $baseline
+	fi
+	cat $perflog
+    } | sort > $baseline.tmp && mv $baseline.tmp $baseline
+    echo "Baseline written to $baseline"
+fi
+
 exit $globalerror
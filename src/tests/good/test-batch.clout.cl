@@ -0,0 +1,86 @@
+__constant sampler_t sampler =  CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// sip:stencil apply_filter rows -1 1 cols -1 1
+__kernel void apply_filter(__read_only image2d_t in_image, __write_only image2d_t out_image, __constant float* filter)
+{
+   const int2 pos = {get_global_id(0), get_global_id(1)};
+   if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
+
+   float4 sum = (float4)(0.0f);
+   for (int y = -1; y <= 1; y++)
+   {
+       for (int x = -1; x <= 1; x++)
+       {
+           sum.x += filter[(y + 1) * 3 + (x + 1)] * read_imagef(in_image, sampler, pos + (int2)(x,y)).x;
+           sum.y += filter[(y + 1) * 3 + (x + 1)] * read_imagef(in_image, sampler, pos + (int2)(x,y)).y;
+           sum.z += filter[(y + 1) * 3 + (x + 1)] * read_imagef(in_image, sampler, pos + (int2)(x,y)).z;
+       }
+   }
+
+   write_imagef (out_image, (int2)(pos.x, pos.y), sum);
+}
+
+// sip:stencil blur rows -1 1 cols -1 1
+__kernel void blur(__read_only image2d_t in_image , __write_only image2d_t out_image)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
+float blue_out;
+float green_out;
+float red_out;
+int y;
+int x;
+
+red_out = 0.;
+green_out = 0.;
+blue_out = 0.;
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(-1,-1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(-1,-1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(-1,-1)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(0,-1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(0,-1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(0,-1)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(1,-1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(1,-1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(1,-1)).z / 9;
+
+x = 2;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(-1,0)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(-1,0)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(-1,0)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(0,0)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(0,0)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(0,0)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(1,0)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(1,0)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(1,0)).z / 9;
+
+x = 2;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(-1,1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(-1,1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(-1,1)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(0,1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(0,1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(0,1)).z / 9;
+
+red_out = red_out + read_imagef(in_image, sampler, pos + (int2)(1,1)).x / 9;
+green_out = green_out + read_imagef(in_image, sampler, pos + (int2)(1,1)).y / 9;
+blue_out = blue_out + read_imagef(in_image, sampler, pos + (int2)(1,1)).z / 9;
+
+x = 2;
+
+y = 2;
+
+
+    float4 _out_ = {red_out, green_out, blue_out, 0.0f};
+    write_imagef (out_image, (int2)(pos.x, pos.y), _out_);
+}
+
+
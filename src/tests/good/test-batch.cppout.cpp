@@ -0,0 +1,50 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    g_clProgram.CompileClFile("./test-batch.cl");
+
+ImageArray blurred("main.blurred");
+ImageArray tiles("main.tiles");
+
+tiles.read("./tiles.txt");
+g_clProgram.RunKernel(tiles, blurred,"blur", 12);
+blurred.resize(blurred.size());
+for (int __sip_b__ = 0; __sip_b__ < blurred.size(); ++__sip_b__)
+{
+Image& __sip_src__ = blurred[__sip_b__];
+Image& g__sip_temp__ = blurred[__sip_b__];
+g__sip_temp__.clone(__sip_src__);
+for (int row = 0; row <__sip_src__.height(); ++row)
+{
+    for (int col = 0; col <__sip_src__.width(); ++col)
+    {
+        unsigned int red = __sip_src__(row, col)->Red;
+        unsigned int red_out = __sip_src__(row, col)->Red;
+        unsigned int green = __sip_src__(row, col)->Green;
+        unsigned int green_out = __sip_src__(row, col)->Green;
+        unsigned int blue = __sip_src__(row, col)->Blue;
+        unsigned int blue_out = __sip_src__(row, col)->Blue;
+
+red_out = red;
+green_out = green;
+blue_out = 255 - blue;
+
+        g__sip_temp__(row, col)->Red   = (char)red_out;
+        g__sip_temp__(row, col)->Green = (char)green_out;
+        g__sip_temp__(row, col)->Blue  = (char)blue_out;
+        g__sip_temp__(row, col)->Alpha = __sip_src__(row, col)->Alpha;
+    }
+}
+}
+std::cout << blurred.size() << std::endl;
+blurred.save("./test-batch-%02d.bmp");
+
+
+    return Image::flush();
+}
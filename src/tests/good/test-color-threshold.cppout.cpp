@@ -2,15 +2,16 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-color-threshold.cl");
 
-Image dst;
-Image src;
+Image dst("main.dst");
+Image src("main.src");
 
 src.read("./blackbuck.bmp");
 g__sip_temp__.clone(src);
@@ -37,10 +38,10 @@ blue_out = ((blue > 128)) ? 255:0;
 }
 
 dst = g__sip_temp__;
-dst.write("./test-color-threshold.bmp");
+dst.save("./test-color-threshold.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
@@ -2,15 +2,16 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-color-to-gray.cl");
 
-Image dst;
-Image src;
+Image dst("main.dst");
+Image src("main.src");
 
 src.read("./blackbuck.bmp");
 g__sip_temp__.clone(src);
@@ -37,10 +38,10 @@ blue_out = 0.2126 * red + 0.7152 * green + 0.0722 * blue;
 }
 
 dst = g__sip_temp__;
-dst.write("./test-color-to-gray.bmp");
+dst.save("./test-color-to-gray.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
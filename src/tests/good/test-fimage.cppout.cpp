@@ -0,0 +1,54 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+FloatImage g__sip_float__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-fimage.cl");
+
+FloatImage sharp("main.sharp");
+FloatImage hdr("main.hdr");
+Image src("main.src");
+float edge[3][3] = {{0., -1., 0.}, {-1., 5., -1.}, {0., -1., 0.}};
+
+src.read("./blackbuck.bmp");
+hdr = src;
+g__sip_float__.clone(hdr);
+for (int row = 0; row <hdr.height(); ++row)
+{
+    for (int col = 0; col <hdr.width(); ++col)
+    {
+        float red = hdr(row, col)->Red;
+        float red_out = hdr(row, col)->Red;
+        float green = hdr(row, col)->Green;
+        float green_out = hdr(row, col)->Green;
+        float blue = hdr(row, col)->Blue;
+        float blue_out = hdr(row, col)->Blue;
+
+red_out = 3. * red / (1. + 2. * red);
+green_out = 3. * green / (1. + 2. * green);
+blue_out = 3. * blue / (1. + 2. * blue);
+
+        g__sip_float__(row, col)->Red   = red_out;
+        g__sip_float__(row, col)->Green = green_out;
+        g__sip_float__(row, col)->Blue  = blue_out;
+        g__sip_float__(row, col)->Alpha = hdr(row, col)->Alpha;
+    }
+}
+
+hdr = g__sip_float__;
+g_clProgram.ApplyFilter(hdr, g__sip_float__, (float*)&edge, 18);
+
+sharp = g__sip_float__;
+sharp.save("./test-fimage.bmp");
+
+
+    return Image::flush();
+}
+
+
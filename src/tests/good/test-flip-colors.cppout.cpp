@@ -2,15 +2,16 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-flip-colors.cl");
 
-Image im2;
-Image im1;
+Image im2("main.im2");
+Image im1("main.im1");
 
 im1.read("./blackbuck.bmp");
 g__sip_temp__.clone(im1);
@@ -37,10 +38,10 @@ blue_out = red;
 }
 
 im2 = g__sip_temp__;
-im2.write("./test-flip-colors.bmp");
+im2.save("./test-flip-colors.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
@@ -1,8 +1,10 @@
 __constant sampler_t sampler =  CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
+// sip:stencil apply_filter rows -1 1 cols -1 1
 __kernel void apply_filter(__read_only image2d_t in_image, __write_only image2d_t out_image, __constant float* filter)
 {
    const int2 pos = {get_global_id(0), get_global_id(1)};
+   if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
 
    float4 sum = (float4)(0.0f);
    for (int y = -1; y <= 1; y++)
@@ -2,7 +2,7 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int add(int x , int y)
@@ -22,7 +22,7 @@ int main()
 std::cout << add(100, 100) << std::endl;
 
 
-    return 0;
+    return Image::flush();
 }
 
 
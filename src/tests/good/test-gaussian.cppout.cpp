@@ -0,0 +1,51 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-gaussian.cl");
+
+Image dst("main.dst");
+Image background("main.background");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.gaussian(25., g__sip_temp__);
+
+background = g__sip_temp__;
+g__sip_temp__.clone(src);
+for (int row = 0; row <src.height(); ++row)
+{
+    for (int col = 0; col <src.width(); ++col)
+    {
+        unsigned int red = src(row, col)->Red;
+        unsigned int red_out = src(row, col)->Red;
+        unsigned int green = src(row, col)->Green;
+        unsigned int green_out = src(row, col)->Green;
+        unsigned int blue = src(row, col)->Blue;
+        unsigned int blue_out = src(row, col)->Blue;
+
+red_out = ((red > background(row,col)->Red)) ? red - background(row,col)->Red:0;
+green_out = ((green > background(row,col)->Green)) ? green - background(row,col)->Green:0;
+blue_out = ((blue > background(row,col)->Blue)) ? blue - background(row,col)->Blue:0;
+
+        g__sip_temp__(row, col)->Red   = (char)red_out;
+        g__sip_temp__(row, col)->Green = (char)green_out;
+        g__sip_temp__(row, col)->Blue  = (char)blue_out;
+        g__sip_temp__(row, col)->Alpha = src(row, col)->Alpha;
+    }
+}
+
+dst = g__sip_temp__;
+dst.save("./test-gaussian.bmp");
+
+
+    return Image::flush();
+}
+
+
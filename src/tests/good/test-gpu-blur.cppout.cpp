@@ -2,25 +2,26 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-gpu-blur.cl");
 
-Image im2;
-Image im1;
+Image im2("main.im2");
+Image im1("main.im1");
 float filter[3][3] = {{0.11, 0.11, 0.11}, {0.11, 0.11, 0.11}, {0.11, 0.11, 0.11}};
 
 im1.read("./blackbuck.bmp");
-g_clProgram.ApplyFilter(im1, g__sip_temp__, (float*)&filter);
+g_clProgram.ApplyFilter(im1, g__sip_temp__, (float*)&filter, 10);
 
 im2 = g__sip_temp__;
-im2.write("./test-gpu-blur.bmp");
+im2.save("./test-gpu-blur.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
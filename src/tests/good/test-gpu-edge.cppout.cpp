@@ -2,25 +2,26 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-gpu-edge.cl");
 
-Image dst;
-Image src;
+Image dst("main.dst");
+Image src("main.src");
 float edge[3][3] = {{0., -1., 0.}, {-1., 5., -1.}, {0., -1., 0.}};
 
 src.read("./blackbuck.bmp");
-g_clProgram.ApplyFilter(src, g__sip_temp__, (float*)&edge);
+g_clProgram.ApplyFilter(src, g__sip_temp__, (float*)&edge, 15);
 
 dst = g__sip_temp__;
-dst.write("./test-gpu-edge.bmp");
+dst.save("./test-gpu-edge.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
@@ -2,24 +2,25 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-gpu-kfun-blur.cl");
 
-Image dst;
-Image src;
+Image dst("main.dst");
+Image src("main.src");
 
 src.read("./blackbuck.bmp");
-g_clProgram.RunKernel(src, g__sip_temp__,"blur");
+g_clProgram.RunKernel(src, g__sip_temp__,"blur", 12);
 
 dst = g__sip_temp__;
-dst.write("./test-gpu-kfun-blur.bmp");
+dst.save("./test-gpu-kfun-blur.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
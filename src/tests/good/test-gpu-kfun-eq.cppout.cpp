@@ -0,0 +1,27 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-gpu-kfun-eq.cl");
+
+Image dst("main.dst");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+g_clProgram.RunKernel(src, g__sip_temp__,"once", 12);
+
+dst = g__sip_temp__;
+dst.save("./test-gpu-kfun-eq.bmp");
+
+
+    return Image::flush();
+}
+
+
+
@@ -0,0 +1,44 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+Gray g__sip_gray__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-gray.cl");
+
+Gray mask("main.mask");
+Gray level("main.level");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+level = src;
+g__sip_gray__.clone(level);
+for (int row = 0; row <level.height(); ++row)
+{
+    for (int col = 0; col <level.width(); ++col)
+    {
+        unsigned int luma = level(row, col)->Luma;
+        unsigned int luma_out = level(row, col)->Luma;
+
+luma_out = ((luma > 100)) ? 255:0;
+
+        g__sip_gray__(row, col)->Luma = (char)luma_out;
+    }
+}
+
+mask = g__sip_gray__;
+mask.morphology(Image::Open, 3, 3, g__sip_gray__);
+
+mask = g__sip_gray__;
+mask.save("./test-gray.bmp");
+
+
+    return Image::flush();
+}
+
+
@@ -2,21 +2,22 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-img-attr.cl");
 
-Image src;
+Image src("main.src");
 
 src.read("./blackbuck.bmp");
 std::cout << src.width() << std::endl;
 std::cout << src.height() << std::endl;
 
 
-    return 0;
+    return Image::flush();
 }
 
 
@@ -0,0 +1,35 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-img-pixels.cl");
+
+int red;
+Image wide("main.wide");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.copyRangeTo(200, 300, 100, 40, g__sip_temp__);
+wide = g__sip_temp__;
+std::cout << wide.width() << std::endl;
+std::cout << wide.height() << std::endl;
+red = wide(39,99)->Red;
+std::cout << red << std::endl;
+red = src(339,299)->Red;
+std::cout << red << std::endl;
+red = wide(0,99)->Red;
+std::cout << red << std::endl;
+red = src(300,299)->Red;
+std::cout << red << std::endl;
+
+
+    return Image::flush();
+}
+
+
@@ -2,23 +2,24 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-img-range.cl");
 
-Image im2;
-Image im1;
+Image im2("main.im2");
+Image im1("main.im1");
 
 im1.read("./blackbuck.bmp");
 im1.copyRangeTo(0, 0, 100, 100, g__sip_temp__);
 im2 = g__sip_temp__;
-im2.write("./test-img-range.bmp");
+im2.save("./test-img-range.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
@@ -2,20 +2,21 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
 {
+    Image::prefetch("./blackbuck.bmp");
     g_clProgram.CompileClFile("./test-img-read-write.cl");
 
-Image im;
+Image im("main.im");
 
 im.read("./blackbuck.bmp");
-im.write("./test-img-read-write.bmp");
+im.save("./test-img-read-write.bmp");
 
 
-    return 0;
+    return Image::flush();
 }
 
 
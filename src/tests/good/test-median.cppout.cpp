@@ -0,0 +1,27 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-median.cl");
+
+int radius = 2;
+Image dst("main.dst");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.median(radius, g__sip_temp__);
+
+dst = g__sip_temp__;
+dst.save("./test-median.bmp");
+
+
+    return Image::flush();
+}
+
+
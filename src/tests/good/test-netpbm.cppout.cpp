@@ -0,0 +1,25 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-netpbm.cl");
+
+Image frame("main.frame");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.save("./test-netpbm.ppm");
+frame.read("./test-netpbm.ppm");
+frame.save("./test-netpbm.pgm");
+
+
+    return Image::flush();
+}
+
+
@@ -0,0 +1,108 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-parfor.cl");
+
+int level;
+int i;
+Image ref("main.ref");
+Image dst("main.dst");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.copyRangeTo(0, 0, 400, 300, g__sip_temp__);
+dst = g__sip_temp__;
+{
+vector<int> __sip_parfor__;
+for (i = 0 ; i < 4 ; i = i + 1) 
+{
+__sip_parfor__.push_back(i);
+}
+unique_ptr<Image> __sip_last_dst__;
+unique_ptr<int> __sip_last_level__;
+ThreadPool::ParallelFor(__sip_parfor__.size(), [&](size_t __sip_k__)
+{
+[&, dst, level]() mutable
+{
+int i = __sip_parfor__[__sip_k__];
+Image g__sip_temp__("(temporary)");
+level = 64 * i;
+g__sip_temp__.clone(dst);
+for (int row = 0; row <dst.height(); ++row)
+{
+    for (int col = 0; col <dst.width(); ++col)
+    {
+        unsigned int red = dst(row, col)->Red;
+        unsigned int red_out = dst(row, col)->Red;
+        unsigned int green = dst(row, col)->Green;
+        unsigned int green_out = dst(row, col)->Green;
+        unsigned int blue = dst(row, col)->Blue;
+        unsigned int blue_out = dst(row, col)->Blue;
+
+red_out = ((red > level)) ? 255:0;
+green_out = ((green > level)) ? 255:0;
+blue_out = ((blue > level)) ? 255:0;
+
+        g__sip_temp__(row, col)->Red   = (char)red_out;
+        g__sip_temp__(row, col)->Green = (char)green_out;
+        g__sip_temp__(row, col)->Blue  = (char)blue_out;
+        g__sip_temp__(row, col)->Alpha = dst(row, col)->Alpha;
+    }
+}
+
+dst = g__sip_temp__;
+
+if (__sip_k__ + 1 == __sip_parfor__.size())
+{
+__sip_last_dst__.reset(new Image(dst));
+__sip_last_level__.reset(new int(level));
+}
+}();
+});
+if (!__sip_parfor__.empty())
+{
+dst = *__sip_last_dst__;
+level = *__sip_last_level__;
+}
+}
+src.copyRangeTo(0, 0, 400, 300, g__sip_temp__);
+ref = g__sip_temp__;
+g__sip_temp__.clone(ref);
+for (int row = 0; row <ref.height(); ++row)
+{
+    for (int col = 0; col <ref.width(); ++col)
+    {
+        unsigned int red = ref(row, col)->Red;
+        unsigned int red_out = ref(row, col)->Red;
+        unsigned int green = ref(row, col)->Green;
+        unsigned int green_out = ref(row, col)->Green;
+        unsigned int blue = ref(row, col)->Blue;
+        unsigned int blue_out = ref(row, col)->Blue;
+
+red_out = ((red > level)) ? 255:0;
+green_out = ((green > level)) ? 255:0;
+blue_out = ((blue > level)) ? 255:0;
+
+        g__sip_temp__(row, col)->Red   = (char)red_out;
+        g__sip_temp__(row, col)->Green = (char)green_out;
+        g__sip_temp__(row, col)->Blue  = (char)blue_out;
+        g__sip_temp__(row, col)->Alpha = ref(row, col)->Alpha;
+    }
+}
+
+ref = g__sip_temp__;
+
+std::cout << level << std::endl;
+std::cout << dst.sum(Image::Red) / 255 << std::endl;
+std::cout << ref.sum(Image::Red) / 255 << std::endl;
+
+
+    return Image::flush();
+}
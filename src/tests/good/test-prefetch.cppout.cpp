@@ -0,0 +1,28 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+Gray g__sip_gray__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-prefetch.cl");
+
+Image mask("main.mask");
+Gray level("main.level");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+level.read("./blackbuck.bmp");
+level.save("./test-prefetch-mask.bmp");
+mask.read("./test-prefetch-mask.bmp");
+mask.save("./test-prefetch.bmp");
+
+
+    return Image::flush();
+}
+
+
@@ -0,0 +1,25 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-raw.cl");
+
+Image stage("main.stage");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+src.save("./test-raw.raw");
+stage.read("./test-raw.raw");
+stage.save("./test-raw.bmp");
+
+
+    return Image::flush();
+}
+
+
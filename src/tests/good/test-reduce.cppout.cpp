@@ -0,0 +1,27 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-reduce.cl");
+
+float average;
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+average = src.mean(Image::Red);
+std::cout << average << std::endl;
+std::cout << src.sum(Image::Green) << std::endl;
+std::cout << src.max(Image::Blue) - src.min(Image::Blue) << std::endl;
+std::cout << src.stddev(Image::Red) << std::endl;
+
+
+    return Image::flush();
+}
+
+
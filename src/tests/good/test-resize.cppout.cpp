@@ -0,0 +1,36 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    Image::prefetch("./blackbuck.bmp");
+    g_clProgram.CompileClFile("./test-resize.cl");
+
+int width;
+Image thumb("main.thumb");
+Image src("main.src");
+
+src.read("./blackbuck.bmp");
+width = src.width() / 4;
+src.resizeTo(width, src.height() / 4, Image::Area, g__sip_temp__);
+
+thumb = g__sip_temp__;
+thumb.save("./test-resize-area.bmp");
+src.resizeTo(2 * src.width(), 2 * src.height(), Image::Bilinear, g__sip_temp__);
+
+thumb = g__sip_temp__;
+thumb.save("./test-resize-bilinear.bmp");
+src.resizeTo(100, 100, Image::Nearest, g__sip_temp__);
+
+thumb = g__sip_temp__;
+thumb.save("./test-resize-nearest.bmp");
+
+
+    return Image::flush();
+}
+
+
@@ -0,0 +1,54 @@
+#include "sip.h"
+using namespace Sip;
+
+ClProgram g_clProgram;
+Image g__sip_temp__("(temporary)");
+
+
+int main()
+{
+    g_clProgram.CompileClFile("./test-stream.cl");
+
+Image dst("main.dst");
+Image frame("main.frame");
+Stream inverted("main.inverted");
+Stream frames("main.frames");
+
+frames.read("./frame_%05d.bmp");
+inverted.write("./test-stream-%05d.bmp");
+while (frames.more()) 
+{
+frames.next(frame);
+g__sip_temp__.clone(frame);
+for (int row = 0; row <frame.height(); ++row)
+{
+    for (int col = 0; col <frame.width(); ++col)
+    {
+        unsigned int red = frame(row, col)->Red;
+        unsigned int red_out = frame(row, col)->Red;
+        unsigned int green = frame(row, col)->Green;
+        unsigned int green_out = frame(row, col)->Green;
+        unsigned int blue = frame(row, col)->Blue;
+        unsigned int blue_out = frame(row, col)->Blue;
+
+red_out = 255 - red;
+green_out = 255 - green;
+blue_out = 255 - blue;
+
+        g__sip_temp__(row, col)->Red   = (char)red_out;
+        g__sip_temp__(row, col)->Green = (char)green_out;
+        g__sip_temp__(row, col)->Blue  = (char)blue_out;
+        g__sip_temp__(row, col)->Alpha = frame(row, col)->Alpha;
+    }
+}
+
+dst = g__sip_temp__;
+inverted.push(dst);
+
+}
+
+
+    return Image::flush();
+}
+
+
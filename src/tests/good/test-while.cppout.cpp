@@ -2,7 +2,7 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
@@ -21,7 +21,7 @@ sum = sum + 1;
 std::cout << sum << std::endl;
 
 
-    return 0;
+    return Image::flush();
 }
 
 
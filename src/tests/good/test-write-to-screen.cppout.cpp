@@ -2,7 +2,7 @@
 using namespace Sip;
 
 ClProgram g_clProgram;
-Image g__sip_temp__;
+Image g__sip_temp__("(temporary)");
 
 
 int main()
@@ -15,7 +15,7 @@ std::cout << 1 + 1 << std::endl;
 std::cout << 1. / 2. << std::endl;
 
 
-    return 0;
+    return Image::flush();
 }
 
 
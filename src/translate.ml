@@ -22,19 +22,30 @@ type env = {
     local_var     : var_type StringMap.t; (* locals + function params and their types *)
   }
 
+(* Set by "sip -c -profile": every statement is timed and the program writes a Chrome trace *)
+let profile = ref false
+
 (* Begining of the C++ file. *)
 let cc_headers = "#include \"sip.h\"\n"         ^
                  "using namespace Sip;\n\n"     ^
 			     "ClProgram g_clProgram;\n"     ^
-				 "Image g__sip_temp__;\n\n"
+				 "Image g__sip_temp__(\"(temporary)\");\n"
+
+(* Temporaries of the image expressions on gray and float images, declared by the programs
+   that have some *)
+let cc_typed_temps = [(Gray, "Gray g__sip_gray__(\"(temporary)\");\n");
+                      (FloatImage, "FloatImage g__sip_float__(\"(temporary)\");\n")]
 
-(* Begining of the OpenCL header, and a generic function for 3x3 filter *)
+(* Begining of the OpenCL header, and a generic function for 3x3 filter. The runtime pads the
+   global size to a multiple of the work-group size, so kernels skip the pixels outside the image. *)
 let cl_headers = 
 "__constant sampler_t sampler =  CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
+// sip:stencil apply_filter rows -1 1 cols -1 1
 __kernel void apply_filter(__read_only image2d_t in_image, __write_only image2d_t out_image, __constant float* filter)
 {
    const int2 pos = {get_global_id(0), get_global_id(1)};
+   if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
 
    float4 sum = (float4)(0.0f);
    for (int y = -1; y <= 1; y++)
@@ -50,6 +61,180 @@ __kernel void apply_filter(__read_only image2d_t in_image, __write_only image2d_
    write_imagef (out_image, (int2)(pos.x, pos.y), sum);
 }\n"
 
+(* Name of the first function called in an expression *)
+let rec first_call = function
+    Call(f, _) -> Some f
+  | Assign(_, e) -> first_call e
+  | Unop(_, e) -> first_call e
+  | Bracket(e) -> first_call e
+  | Binop(e1, _, e2) -> (match first_call e1 with None -> first_call e2 | f -> f)
+  | Ques(e1, e2, e3) ->
+      (match first_call e1 with
+         None -> (match first_call e2 with None -> first_call e3 | f -> f)
+       | f -> f)
+  | _ -> None
+
+(* Name of the trace span of a statement *)
+let rec span_name = function
+    Block(_) -> "block"
+  | Expr(e) -> (match first_call e with Some f -> "call " ^ f | None -> "expr")
+  | Imexpr(e) ->
+      let rec img_span = function
+          Imop(s, _, k) -> s ^ " ^ " ^ k
+        | In(v, _, _) -> "in " ^ v
+        | Imassign(v, e) -> v ^ " = " ^ img_span e
+        | Imrange(v, _, _, _, _) -> "range " ^ v
+        | Imresize(v, _, _, _) -> "resize " ^ v
+        | Imintegral(v) -> "integral " ^ v
+        | Imfilter(s, f, _) -> s ^ " ^ " ^ f in
+      img_span e
+  | Imread(i, _) -> "read " ^ i
+  | Imwrite(i, _) -> "write " ^ i
+  | Streamread(_, s) -> "next " ^ s
+  | Streamwrite(_, s) -> "push " ^ s
+  | Return(_) -> "return"
+  | If(_, _, _) -> "if"
+  | For(_, _, _, _) -> "for"
+  | Parfor(_, _, _, _) -> "parfor"
+  | While(_, _) -> "while"
+  | Break -> "break"
+  | Located(_, s) -> span_name s
+
+(* Kernel loops with constant bounds are unrolled up to this many iterations *)
+let max_unroll = 16
+
+(* Evaluate an integer expression whose leaves are literals or loop counters bound in "consts" *)
+let rec const_int consts = function
+    IntLiteral(l) -> Some l
+  | Id(s) -> if (StringMap.mem s consts) then Some (StringMap.find s consts) else None
+  | Unop(Neg, e) -> (match const_int consts e with Some n -> Some (-n) | None -> None)
+  | Bracket(e) -> const_int consts e
+  | Binop(e1, op, e2) ->
+      (match (const_int consts e1, const_int consts e2) with
+         (Some a, Some b) ->
+           (match op with
+              Add -> Some (a + b)
+            | Sub -> Some (a - b)
+            | Mult -> Some (a * b)
+            | Div -> if (b != 0) then Some (a / b) else None
+            | Mod -> if (b != 0) then Some (a mod b) else None
+            | _ -> None)
+       | _ -> None)
+  | _ -> None
+
+(* True if the expression assigns the variable v *)
+let rec expr_assigns v = function
+    Assign(s, e) -> ((String.compare s v) == 0) || expr_assigns v e
+  | Unop(_, e) -> expr_assigns v e
+  | Bracket(e) -> expr_assigns v e
+  | Binop(e1, _, e2) -> expr_assigns v e1 || expr_assigns v e2
+  | Call(_, el) -> List.exists (expr_assigns v) el
+  | Ques(e1, e2, e3) -> expr_assigns v e1 || expr_assigns v e2 || expr_assigns v e3
+  | Imaccessor(_, r, c, _) -> expr_assigns v r || expr_assigns v c
+  | _ -> false
+
+(* A loop body can be unrolled if it never touches its counter and never leaves the loop early *)
+let rec unrollable v = function
+    Block(sl) -> List.for_all (unrollable v) sl
+  | Expr(e) -> not (expr_assigns v e)
+  | Return(_) -> false
+  | Break -> false
+  | If(e, s1, s2) -> not (expr_assigns v e) && unrollable v s1 && unrollable v s2
+  | For(e1, e2, e3, s) -> not (List.exists (expr_assigns v) [e1; e2; e3]) && unrollable v s
+  | While(e, s) -> not (expr_assigns v e) && unrollable v s
+  | Located(_, s) -> unrollable v s
+  | _ -> true
+
+(* Return the counter, its values and its final value for a loop of the form
+   "for (v = a; v < b; v = v + c)" with constant a, b and c and a <, <=, >, >= or != bound,
+   or None if the loop must stay a loop *)
+let unroll_range consts e1 e2 e3 s =
+  match (e1, e2, e3) with
+    (Assign(v, init), Binop(Id(v2), cmp, bound), Assign(v3, Binop(Id(v4), step_op, step)))
+      when v = v2 && v = v3 && v = v4 && unrollable v s ->
+      (match (const_int consts init, const_int consts bound, const_int consts step) with
+         (Some i0, Some b, Some st) ->
+           let st = (match step_op with Add -> st | Sub -> -st | _ -> 0) in
+           let rec iterate test i n acc =
+             if not (test i) then Some (v, List.rev acc, i)
+             else if ((n >= max_unroll) || (st == 0)) then None
+             else iterate test (i + st) (n + 1) (i :: acc) in
+           (match cmp with
+              Lt -> iterate (fun i -> i < b) i0 0 []
+            | Leq -> iterate (fun i -> i <= b) i0 0 []
+            | Gt -> iterate (fun i -> i > b) i0 0 []
+            | Geq -> iterate (fun i -> i >= b) i0 0 []
+            | Neq -> iterate (fun i -> i != b) i0 0 []
+            | _ -> None)
+       | _ -> None)
+  | _ -> None
+
+(* Variables assigned by an expression *)
+let rec expr_assigned = function
+    Assign(s, e) -> s :: expr_assigned e
+  | Unop(_, e) -> expr_assigned e
+  | Bracket(e) -> expr_assigned e
+  | Binop(e1, _, e2) -> expr_assigned e1 @ expr_assigned e2
+  | Call(_, el) -> List.concat (List.map expr_assigned el)
+  | Ques(e1, e2, e3) -> expr_assigned e1 @ expr_assigned e2 @ expr_assigned e3
+  | Imaccessor(_, r, c, _) -> expr_assigned r @ expr_assigned c
+  | _ -> []
+
+(* Variables and images written by a statement, these are private to each iteration of a parfor *)
+let rec stmt_assigned = function
+    Block(sl) -> List.concat (List.map stmt_assigned sl)
+  | Expr(e) -> expr_assigned e
+  | Return(e) -> expr_assigned e
+  | If(e, s1, s2) -> expr_assigned e @ stmt_assigned s1 @ stmt_assigned s2
+  | For(e1, e2, e3, s) -> List.concat (List.map expr_assigned [e1; e2; e3]) @ stmt_assigned s
+  | Parfor(e1, e2, e3, s) -> List.concat (List.map expr_assigned [e1; e2; e3]) @ stmt_assigned s
+  | While(e, s) -> expr_assigned e @ stmt_assigned s
+  | Imexpr(e) ->
+      let rec img_assigned = function
+          Imassign(v, e) -> v :: img_assigned e
+        | _ -> [] in
+      img_assigned e
+  | Imread(i, _) -> [i]
+  | Streamread(i, s) -> [i; s]
+  | Streamwrite(_, s) -> [s]
+  | Located(_, s) -> stmt_assigned s
+  | _ -> []
+
+(* Files read (true) and written (false) by the images of a statement, in program order *)
+let rec stmt_files = function
+    Block(sl) -> List.concat (List.map stmt_files sl)
+  | If(_, s1, s2) -> stmt_files s1 @ stmt_files s2
+  | For(_, _, _, s) | Parfor(_, _, _, s) | While(_, s) | Located(_, s) -> stmt_files s
+  | Imread(i, p) -> [(true, i, p)]
+  | Imwrite(i, p) -> [(false, i, p)]
+  | _ -> []
+
+(* True if a statement returns, or breaks out of the loop enclosing it when not in_loop *)
+let rec exits in_loop = function
+    Block(sl) -> List.exists (exits in_loop) sl
+  | Return(_) -> true
+  | Break -> not in_loop
+  | If(_, s1, s2) -> exits in_loop s1 || exits in_loop s2
+  | For(_, _, _, s) -> exits true s
+  | Parfor(_, _, _, s) -> exits true s
+  | While(_, s) -> exits true s
+  | Located(_, s) -> exits in_loop s
+  | _ -> false
+
+(* Built-in functions reducing a channel of an image to a scalar, e.g. "mean(img->Red)" *)
+let reductions = ["sum"; "min"; "max"; "mean"; "stddev"]
+let channels = ["Red"; "Green"; "Blue"; "Alpha"]
+
+(* Built-in box queries of an integral, e.g. "boxmean(table->Red, row, col, 15)" *)
+let box_queries = ["boxsum"; "boxmean"; "boxvar"]
+
+(* C++ variable definition, images are constructed with their SIP name ("function.variable" for
+   locals), the runtime accounts their memory under it *)
+let add_cc_vdef b scope = function
+    VarDecl({ vtype = (Image | ImageArray | Stream | Integral | Gray | FloatImage) as t; vname = n }) ->
+      Buffer.add_string b (Ast.string_of_vartype t ^ " " ^ n ^ "(\"" ^ scope ^ n ^ "\");\n")
+  | v -> Ast.add_vdef b v
+
 (* Return a string represntation of function signature *)
 let fsig fdecl =
   fdecl.fname ^ "_" ^ String.concat "_" (List.map Ast.string_of_vdecl fdecl.fparams)
@@ -83,12 +268,19 @@ let rec enum_func = function
 let string_map_pairs map pairs =
   List.fold_left (fun m (i, n) -> StringMap.add n i m) map pairs
   
-(* Translate the AST tree into a C++ program *)
+(* Translate the AST tree into a C++ program. The code is appended to one buffer, nested
+   statements are never copied into their parents. *)
 let translate_to_cc (globals, functions) out_name =
 
   (* Allocate "addresses" for each global variable *)
   let global_variables = string_map_pairs StringMap.empty (enum_vdef globals) in
   let function_decls = string_map_pairs StringMap.empty (enum_func functions) in
+  let b = Buffer.create 65536 in
+  let add s = Buffer.add_string b s in
+  let declared = enum_vdef globals @
+                 List.concat (List.map (fun f -> enum_vdef f.flocals @ enum_vdecl f.fparams) functions) in
+  let typed_temps = List.filter (fun (t, _) -> List.exists (fun (d, _) -> d == t) declared) cc_typed_temps in
+  let add_typed_temps () = List.iter (fun (_, d) -> add d) typed_temps in
 
   (* Translate a function in AST form into a list of bytecode statements *)
   let translate env fdecl =
@@ -96,114 +288,268 @@ let translate_to_cc (globals, functions) out_name =
     and formal_var = enum_vdecl fdecl.fparams in
     let env = { env with local_var = string_map_pairs StringMap.empty (local_var @ formal_var) } in
     let dynamic_var = ref StringMap.empty in
+    let cur_line = ref 0 in (* Source line of the statement being translated *)
+
+    let type_of s =
+      (try StringMap.find s env.local_var
+       with Not_found -> (try StringMap.find s env.global_var with Not_found -> Void)) in
 
     let rec expr e = 
 	  (match e with
-      BoolLiteral(l) -> string_of_bool l
-      | IntLiteral(l) -> string_of_int l
-      | FloatLiteral(l) -> string_of_float l
-      | StringLiteral(l) -> l      
+      BoolLiteral(l) -> add (string_of_bool l)
+      | IntLiteral(l) -> add (string_of_int l)
+      | FloatLiteral(l) -> add (string_of_float l)
+      | StringLiteral(l) -> add l
       | Id(s) -> 
 		  if ((StringMap.mem s env.local_var) || (StringMap.mem s env.global_var) || (StringMap.mem s !dynamic_var))
-            then s
+            then add s
 			else raise (Failure ("undeclared variable " ^ s))
       | Unop(o, e) ->
-          (match o with
-        Neg -> "-") ^ expr e
+          add (match o with
+        Neg -> "-"); expr e
       | Binop (e1, op, e2) -> 
-		  expr e1 ^ " " ^
-          (match op with
-	    Add -> "+" | Sub -> "-" | Mult -> "*" | Div -> "/" | Mod -> "%"
-          | Neq -> "!=" | Lt -> "<" | Leq -> "<=" | Gt -> ">" | Geq -> ">=" | Eq -> "=="
-          | And -> "&&" | Or -> "||" | Not -> "!"
-          | BitAnd -> "&" | BitOr -> "|" | BitNot -> "~") ^ " " ^
-          expr e2
+		  expr e1; add (" " ^ Ast.string_of_op op ^ " "); expr e2
       | Assign (s, e) ->
 		  if ((StringMap.mem s env.local_var) || (StringMap.mem s env.global_var) || (StringMap.mem s !dynamic_var))
-		    then s ^ " = " ^ expr e
+		    then (add (s ^ " = "); expr e)
 		 	else raise (Failure ("undeclared variable " ^ s))
       | Call (fname, actuals) -> 
 		  if (StringMap.mem fname env.function_decl)
-		    then fname ^ "(" ^ String.concat ", " (List.map expr (List.rev actuals)) ^ ")"
+		    then (add (fname ^ "("); Ast.add_list b ", " expr (List.rev actuals); add ")")
 		 	else (if ((String.compare fname "writeln") == 0) then
                 (if ((List.length actuals) == 1) then
-                    "std::cout << " ^ expr (List.hd actuals) ^ " << std::endl"
+                    (add "std::cout << "; expr (List.hd actuals); add " << std::endl")
                 else raise (Failure ("writeln takes only one argument")))
+            else if (List.mem fname reductions) then
+                (match actuals with
+                   [Accessor(i, c)] when (List.mem c channels) && (type_of i == Image) ->
+                     add (i ^ "." ^ fname ^ "(Image::" ^ c ^ ")")
+                 | _ -> raise (Failure (fname ^ " takes one image channel, e.g. " ^ fname ^ "(img->Red)")))
+            else if (List.mem fname box_queries) then
+                (match actuals with
+                   [Accessor(i, c); r; col; radius] when (List.mem c ["Red"; "Green"; "Blue"]) && (type_of i == Integral) ->
+                     add (i ^ "." ^ fname ^ "(Image::" ^ c ^ ", "); expr r; add ", "; expr col; add ", "; expr radius; add ")"
+                 | _ -> raise (Failure (fname ^ " takes an integral channel, a row, a column and a radius, e.g. " ^
+                                        fname ^ "(table->Red, row, col, 15)")))
             else
                 raise (Failure ("undefined function " ^ fname)))
-  	  | Ques (e1, e2, e3) -> "(" ^ expr e1 ^ ") ? " ^
-  	      expr e2 ^ ":" ^ expr e3
-      | Bracket (e) -> "(" ^ expr e ^ ")"
-      | Imaccessor (i, r, c, a) -> i ^ "(" ^ expr r ^ "," ^ expr c ^ ")->" ^ a
+  	  | Ques (e1, e2, e3) -> add "("; expr e1; add ") ? ";
+  	      expr e2; add ":"; expr e3
+      | Bracket (e) -> add "("; expr e; add ")"
+      | Imaccessor (i, r, c, a) -> add (i ^ "("); expr r; add ","; expr c; add (")->" ^ a)
       | Accessor (i, a) -> 
 		  if ((StringMap.mem i env.local_var) || (StringMap.mem i env.global_var) || (StringMap.mem i !dynamic_var))
-            then i ^ "." ^ (match a with
-                              "Width" -> "width()"
-                            | "Height" -> "height()"
-                            | _ -> raise (Failure ("Invalid attribute " ^ a)))
+            then add (i ^ "." ^ (match a with
+                                   "Width" -> "width()"
+                                 | "Height" -> "height()"
+                                 | "Size" -> "size()"
+                                 | "More" -> "more()"
+                                 | _ -> raise (Failure ("Invalid attribute " ^ a))))
 		 	else raise (Failure ("undeclared variable " ^ i))
-      | Noexpr -> "")
+      | Noexpr -> ())
 
    in let add_channels_var c =
       if ((List.length c) != 0)
       then
-        (String.concat "" (List.map (fun f ->
-		  (* print_string ((Ast.get_channel f) ^ "\n"); *)
-		  ignore(dynamic_var := StringMap.add (Ast.get_channel f) Ast.UInt !dynamic_var);
-		  ignore(dynamic_var := StringMap.add ((Ast.get_channel f) ^ "_out") Ast.UInt !dynamic_var);
-		  "") c))
+        List.iter (fun f ->
+		  dynamic_var := StringMap.add (Ast.get_channel f) Ast.UInt !dynamic_var;
+		  dynamic_var := StringMap.add ((Ast.get_channel f) ^ "_out") Ast.UInt !dynamic_var) c
  	else raise (Failure ("empty channel list in an \"In\" statement "))
 
-   in let expand_channels c =
+   in let expand_channels ctype c =
 	    if ((List.length c) != 0)
 	    then
-	      (String.concat "" (List.map (fun f ->
-			  "        unsigned int " ^ Ast.get_channel f ^ " = " ^ Ast.string_of_channel f ^ ";\n" ^
-		      "        unsigned int " ^ Ast.get_channel f ^ "_out = " ^ Ast.string_of_channel f ^ ";\n") c))
+	      List.iter (fun f ->
+			  add ("        " ^ ctype ^ " " ^ Ast.get_channel f ^ " = " ^ Ast.string_of_channel f ^ ";\n" ^
+		           "        " ^ ctype ^ " " ^ Ast.get_channel f ^ "_out = " ^ Ast.string_of_channel f ^ ";\n")) c
 	 	else raise (Failure ("empty channel list in an \"In\" statement "))
 
+    (* Batches ("image[]") are processed straight into the image[] they are assigned to *)
+    in let is_batch s = (type_of s == ImageArray)
+
+    (* Image expressions on a gray or float image produce one of the same type *)
+    in let temp_of s = (match type_of s with
+                          Gray -> "g__sip_gray__"
+                        | FloatImage -> "g__sip_float__"
+                        | _ -> "g__sip_temp__")
+
+    in let kernel_call s k target =
+	  if ((StringMap.mem s env.local_var) || (StringMap.mem s env.global_var)) then begin
+	        if ((StringMap.mem k env.local_var) || (StringMap.mem k env.global_var)) then
+	           add ("g_clProgram.ApplyFilter(" ^ s ^ ", " ^ target ^ ", (float*)&" ^ k ^ ", " ^ string_of_int !cur_line ^ ");\n")
+			else add ("g_clProgram.RunKernel(" ^ s ^ ", " ^ target ^ ",\"" ^ k ^ "\", " ^ string_of_int !cur_line ^ ");\n")
+		end
+	 	else raise (Failure ("undeclared variable " ^ s))
+
+    in let batch_target v s =
+      if (not (is_batch v)) then raise (Failure ("the image[] " ^ s ^ " must be assigned to an image[], not to " ^ v))
+
+    (* Frames move between a stream and an image, one at a time *)
+    in let stream_image i s =
+      if (type_of s != Stream) then raise (Failure (s ^ " isn't a stream"));
+      if (type_of i != Image) then raise (Failure ("a stream frame must be read into or written from an image, not " ^ i))
+
     in let rec img_expr = function
-	      Imop(s, o, k) -> 
-			  if ((StringMap.mem s env.local_var) || (StringMap.mem s env.global_var)) then begin
-			        if ((StringMap.mem k env.local_var) || (StringMap.mem k env.global_var)) then
-			           "g_clProgram.ApplyFilter(" ^ s ^ ", g__sip_temp__, (float*)&" ^ k ^ ");\n"
-					else "g_clProgram.RunKernel(" ^ s ^ ", g__sip_temp__,\"" ^ k ^ "\");\n"
-				end
-			 	else raise (Failure ("undeclared variable " ^ s))
-	    | In (v, a, el) -> ignore(add_channels_var a); (* To force the order, we need to add the variable before evluating the expr. *)
-            "g__sip_temp__.clone(" ^ v ^ ");\n" ^
-            "for (int row = 0; row <" ^ v ^ ".height(); ++row)\n{\n"        ^
-            "    for (int col = 0; col <" ^ v ^ ".width(); ++col)\n    {\n" ^
-            expand_channels a ^ "\n" ^
-	        String.concat ";\n" (List.map expr el) ^ ";\n\n"  ^
-	        "        g__sip_temp__(row, col)->Red   = (char)red_out;\n"   ^
-	        "        g__sip_temp__(row, col)->Green = (char)green_out;\n" ^
-	        "        g__sip_temp__(row, col)->Blue  = (char)blue_out;\n"  ^
-			"        g__sip_temp__(row, col)->Alpha = " ^ v ^ "(row, col)->Alpha;\n" ^
-			"    }\n}\n"
-        | Imassign(v, e) -> img_expr e ^ "\n" ^ v ^ " = g__sip_temp__;\n"
-        | Imrange(v, x, y, w, h) -> v ^ ".copyRangeTo(" ^ string_of_int x ^ ", " ^
-                                                          string_of_int y ^ ", " ^
-                                                          string_of_int w ^ ", " ^
-                                                          string_of_int h ^ ", " ^
-                                                          "g__sip_temp__);"
+	      Imassign(v, Imop(s, o, k)) when is_batch s -> batch_target v s; kernel_call s k v
+	    | Imassign(v, In(s, a, el)) when is_batch s -> batch_target v s;
+	        (* One "in" loop per image, reading the source image and writing the target one *)
+	        add (v ^ ".resize(" ^ s ^ ".size());\n" ^
+	             "for (int __sip_b__ = 0; __sip_b__ < " ^ s ^ ".size(); ++__sip_b__)\n{\n" ^
+	             "Image& __sip_src__ = " ^ s ^ "[__sip_b__];\n" ^
+	             "Image& g__sip_temp__ = " ^ v ^ "[__sip_b__];\n");
+	        img_expr (In("__sip_src__", List.map (fun c -> Channel("__sip_src__", Ast.get_channel c)) a, el));
+	        add "}\n"
+	    | Imop(s, o, k) -> if (is_batch s) then batch_target "g__sip_temp__" s;
+	        kernel_call s k (temp_of s)
+	    | Imassign(v, Imintegral(s)) ->
+	        if (type_of v != Integral) then raise (Failure ("integral(" ^ s ^ ") must be assigned to an integral, not to " ^ v));
+	        if (type_of s != Image) then raise (Failure ("integral takes an image, not " ^ s));
+	        add (v ^ ".build(" ^ s ^ ");\n")
+	    | Imintegral(s) -> raise (Failure ("integral(" ^ s ^ ") must be assigned to an integral"))
+	    | Imfilter(s, f, el) ->
+	        if ((type_of s != Image) && (type_of s != Gray)) then raise (Failure (f ^ " takes an image, not " ^ s));
+	        let temp = temp_of s in
+	        (match (f, el) with
+	           (("erode" | "dilate" | "open" | "close"), ([_] | [_; _])) ->
+	             (* A single size is a square *)
+	             let (w, h) = (List.hd el, List.hd (List.rev el)) in
+	             add (s ^ ".morphology(Image::" ^ String.capitalize f ^ ", "); expr w; add ", "; expr h;
+	             add (", " ^ temp ^ ");\n")
+	         | (("erode" | "dilate" | "open" | "close"), _) ->
+	             raise (Failure (f ^ " takes the width and height of its rectangle, e.g. " ^ s ^ " ^ " ^ f ^ "(5, 5)"))
+	         | ("median", [r]) -> add (s ^ ".median("); expr r; add (", " ^ temp ^ ");\n")
+	         | ("median", _) -> raise (Failure ("median takes the radius of its square, e.g. " ^ s ^ " ^ median(2)"))
+	         | ("gaussian", [sigma]) -> add (s ^ ".gaussian("); expr sigma; add (", " ^ temp ^ ");\n")
+	         | ("gaussian", _) -> raise (Failure ("gaussian takes its standard deviation, e.g. " ^ s ^ " ^ gaussian(4.0)"))
+	         | _ -> raise (Failure ("undefined filter " ^ f)))
+	    | In (v, a, el) when type_of v == Gray ->
+	        (* A gray image has the single channel "luma" *)
+	        (match a with
+	           [c] when (String.compare (Ast.get_channel c) "luma") == 0 -> ()
+	         | _ -> raise (Failure ("the channel of the gray image " ^ v ^ " is luma, e.g. " ^ v ^ " in (luma)")));
+	        dynamic_var := StringMap.add "row" Ast.Int (StringMap.add "col" Ast.Int !dynamic_var);
+	        add_channels_var a;
+            add ("g__sip_gray__.clone(" ^ v ^ ");\n" ^
+                 "for (int row = 0; row <" ^ v ^ ".height(); ++row)\n{\n"        ^
+                 "    for (int col = 0; col <" ^ v ^ ".width(); ++col)\n    {\n");
+            expand_channels "unsigned int" a; add "\n";
+	        Ast.add_list b ";\n" expr el; add ";\n\n";
+	        add ("        g__sip_gray__(row, col)->Luma = (char)luma_out;\n" ^
+			     "    }\n}\n")
+	    | In (v, a, el) -> if (is_batch v) then batch_target "g__sip_temp__" v;
+	        (* Float images keep the channels as floats, the others round them to bytes *)
+	        let (temp, ctype, cast) = if (type_of v == FloatImage) then ("g__sip_float__", "float", "")
+	                                  else ("g__sip_temp__", "unsigned int", "(char)") in
+	        (* The position of the pixel is visible to the expressions, e.g. for box queries *)
+	        dynamic_var := StringMap.add "row" Ast.Int (StringMap.add "col" Ast.Int !dynamic_var);
+	        add_channels_var a; (* To force the order, we need to add the variable before evluating the expr. *)
+            add (temp ^ ".clone(" ^ v ^ ");\n" ^
+                 "for (int row = 0; row <" ^ v ^ ".height(); ++row)\n{\n"        ^
+                 "    for (int col = 0; col <" ^ v ^ ".width(); ++col)\n    {\n");
+            expand_channels ctype a; add "\n";
+	        Ast.add_list b ";\n" expr el; add ";\n\n";
+	        add ("        " ^ temp ^ "(row, col)->Red   = " ^ cast ^ "red_out;\n"   ^
+	             "        " ^ temp ^ "(row, col)->Green = " ^ cast ^ "green_out;\n" ^
+	             "        " ^ temp ^ "(row, col)->Blue  = " ^ cast ^ "blue_out;\n"  ^
+			     "        " ^ temp ^ "(row, col)->Alpha = " ^ v ^ "(row, col)->Alpha;\n" ^
+			     "    }\n}\n")
+        | Imassign(v, e) ->
+            if (is_batch v) then raise (Failure ("only image[] can be assigned to the image[] " ^ v));
+            if (type_of v == Integral) then raise (Failure ("only integral(img) can be assigned to the integral " ^ v));
+            let source = (match e with
+                            Imop(s, _, _) | In(s, _, _) | Imfilter(s, _, _) -> s
+                          | _ -> "") in
+            img_expr e; add ("\n" ^ v ^ " = " ^ temp_of source ^ ";\n")
+        | Imrange(v, x, y, w, h) -> if (is_batch v) then raise (Failure ("range of the image[] " ^ v));
+            if (type_of v == Gray) then raise (Failure ("range of the gray image " ^ v ^ ", assign it to an image first"));
+            if (type_of v == FloatImage) then raise (Failure ("range of the fimage " ^ v ^ ", assign it to an image first"));
+            add (v ^ ".copyRangeTo(" ^ string_of_int x ^ ", " ^
+                                                               string_of_int y ^ ", " ^
+                                                               string_of_int w ^ ", " ^
+                                                               string_of_int h ^ ", " ^
+                                                               "g__sip_temp__);")
+        | Imresize(v, w, h, m) ->
+            if (type_of v != Image) then raise (Failure ("resize takes an image, not " ^ v));
+            add (v ^ ".resizeTo("); expr w; add ", "; expr h;
+            add (", Image::" ^ (match m with
+                                  "nearest" -> "Nearest"
+                                | "bilinear" -> "Bilinear"
+                                | "area" -> "Area"
+                                | _ -> raise (Failure ("Invalid sampling " ^ m ^ ", use nearest, bilinear or area")))
+                 ^ ", g__sip_temp__);\n")
 
     in let rec stmt = function
 	    Block(sl) -> 
-          String.concat "" (List.map stmt sl) ^ "\n"
-	  | Expr(e) -> expr e ^ ";\n";
+          List.iter stmt sl; add "\n"
+	  | Expr(e) -> expr e; add ";\n"
 	  | Imexpr(imexpr) -> img_expr imexpr
-	  | Imread(i, p) -> i ^ ".read(" ^ p ^ ");\n";
-	  | Imwrite(i, p) -> i ^ ".write(" ^ p ^ ");\n";  
-	  | Return(e) -> "return " ^ expr e ^ ";\n";
-	  | If(e, s, Block([])) -> "if (" ^ expr e ^ ")\n{\n" ^ stmt s ^ "}\n"
-      | If(e, s1, s2) ->  "if (" ^ expr e ^ ")\n{\n" ^
-	      stmt s1 ^ "}\nelse\n{\n" ^ stmt s2 ^ "}\n"
+	  | Imread(i, p) -> add (i ^ ".read(" ^ p ^ ");\n")
+	  | Imwrite(i, p) ->
+	      (* Images are copied and written behind the program, main waits for them before it returns *)
+	      if (List.mem (type_of i) [Image; Gray; FloatImage; ImageArray])
+	      then add (i ^ ".save(" ^ p ^ ");\n")
+	      else add (i ^ ".write(" ^ p ^ ");\n")
+	  | Streamread(i, s) -> stream_image i s; add (s ^ ".next(" ^ i ^ ");\n")
+	  | Streamwrite(i, s) -> stream_image i s; add (s ^ ".push(" ^ i ^ ");\n")
+	  | Return(e) -> add "return "; expr e; add ";\n"
+	  | If(e, s, Block([])) -> add "if ("; expr e; add ")\n{\n"; stmt s; add "}\n"
+      | If(e, s1, s2) -> add "if ("; expr e; add ")\n{\n";
+	      stmt s1; add "}\nelse\n{\n"; stmt s2; add "}\n"
 	  | For(e1, e2, e3, s) ->
-	      "for (" ^ expr e1  ^ " ; " ^ expr e2 ^ " ; " ^
-	      expr e3  ^ ") \n{\n" ^ stmt s ^ "}\n"
-	  | While(e, s) -> "while (" ^ expr e ^ ") \n{\n" ^ stmt s ^ "}\n"
-      | Break -> "break;\n"
+	      add "for ("; expr e1; add " ; "; expr e2; add " ; ";
+	      expr e3; add ") \n{\n"; stmt s; add "}\n"
+	  | Parfor(e1, e2, e3, s) ->
+	      (* The counter values are listed sequentially, then each iteration runs on the thread pool
+	         in a lambda of its own: the scalars and images it assigns are copies of the outer ones
+	         and the image temporary is fresh, everything else is shared by reference. The copies of
+	         the last iteration are kept and assigned back to the outer variables once all are done. *)
+	      let v = (match e1 with
+	                 Assign(v, _) when StringMap.mem v env.local_var -> v
+	               | _ -> raise (Failure ("parfor must initialize a local counter"))) in
+	      if (exits false s) then raise (Failure ("parfor iterations can't return or break"));
+	      let written = List.filter (fun n -> (String.compare n v) != 0) (List.sort_uniq compare (stmt_assigned s)) in
+	      List.iter (fun n ->
+	          if (not (StringMap.mem n env.local_var) && (StringMap.mem n env.global_var))
+	          then raise (Failure ("parfor iterations can't assign the global variable " ^ n))) written;
+	      let locals = List.filter (fun n -> StringMap.mem n env.local_var) written in
+	      List.iter (fun n ->
+	          match StringMap.find n env.local_var with
+	            Stream -> raise (Failure ("parfor iterations can't read or write the stream " ^ n))
+	          | ImageArray | Integral -> raise (Failure ("parfor iterations can't assign " ^ n ^ ", it can't be copied"))
+	          | _ -> ()) locals;
+	      let counter = Ast.string_of_vartype (StringMap.find v env.local_var) in
+	      let last n = "__sip_last_" ^ n ^ "__" in
+	      let cc_type n = Ast.string_of_vartype (StringMap.find n env.local_var) in
+	      add ("{\nvector<" ^ counter ^ "> __sip_parfor__;\n");
+	      add "for ("; expr e1; add " ; "; expr e2; add " ; "; expr e3; add ") \n{\n";
+	      add ("__sip_parfor__.push_back(" ^ v ^ ");\n}\n");
+	      List.iter (fun n -> add ("unique_ptr<" ^ cc_type n ^ "> " ^ last n ^ ";\n")) locals;
+	      add "ThreadPool::ParallelFor(__sip_parfor__.size(), [&](size_t __sip_k__)\n{\n";
+	      add ("[&" ^ String.concat "" (List.map (fun n -> ", " ^ n) locals) ^ "]() mutable\n{\n");
+	      add (counter ^ " " ^ v ^ " = __sip_parfor__[__sip_k__];\n");
+	      add "Image g__sip_temp__(\"(temporary)\");\n";
+	      add_typed_temps ();
+	      stmt s;
+	      if (locals <> []) then begin
+	        add "if (__sip_k__ + 1 == __sip_parfor__.size())\n{\n";
+	        List.iter (fun n -> add (last n ^ ".reset(new " ^ cc_type n ^ "(" ^ n ^ "));\n")) locals;
+	        add "}\n"
+	      end;
+	      add "}();\n});\n";
+	      if (locals <> []) then begin
+	        add "if (!__sip_parfor__.empty())\n{\n";
+	        List.iter (fun n -> add (n ^ " = *" ^ last n ^ ";\n")) locals;
+	        add "}\n"
+	      end;
+	      add "}\n"
+	  | While(e, s) -> add "while ("; expr e; add ") \n{\n"; stmt s; add "}\n"
+      | Break -> add "break;\n"
+      | Located(l, s) -> cur_line := l;
+          if (!profile) then begin
+            add ("{\nTraceScope __sip_trace__(\"" ^ span_name s ^ "\", " ^ string_of_int l ^ ");\n");
+            stmt s; add "}\n"
+          end
+          else stmt s
 
     in let vartype = function
         Void -> "void"
@@ -214,6 +560,11 @@ let translate_to_cc (globals, functions) out_name =
       | Matrix3x3 -> "float"
 	  | Histogram -> "Histogram"
 	  | Image -> "Image"
+	  | ImageArray -> "ImageArray"
+	  | Stream -> "Stream"
+	  | Integral -> "Integral"
+	  | Gray -> "Gray"
+	  | FloatImage -> "FloatImage"
 
     in let func_params_type = function
         Void -> "void"
@@ -224,23 +575,43 @@ let translate_to_cc (globals, functions) out_name =
       | Matrix3x3 -> "float"
       | Histogram -> "Histogram&"
       | Image -> "Image&"
+      | ImageArray -> "ImageArray&"
+      | Stream -> "Stream&"
+      | Integral -> "Integral&"
+      | Gray -> "Gray&"
+      | FloatImage -> "FloatImage&"
 	  
-  in  if (fdecl.fgpu) then ""
+  in  if (fdecl.fgpu) then ()
       else begin
           (if ((String.compare fdecl.fname "main") == 0)
-          then "int main()\n{\n" ^ "    g_clProgram.CompileClFile(\"./" ^ out_name ^ ".cl\");\n\n"
-          else (vartype fdecl.freturn) ^ " " ^ fdecl.fname
-          ^ if ((List.length fdecl.fparams) != 0)
-            then ("("
-          ^ func_params_type (List.hd fdecl.fparams).vtype ^ " " ^ (List.hd fdecl.fparams).vname ^ " "
-          ^ String.concat "" (List.map (fun formal -> ", " ^ func_params_type formal.vtype ^ " " ^ formal.vname) (List.tl fdecl.fparams)) ^ ")\n{\n")
-            else "()\n{\n"
-            )
-          ^ String.concat "" (List.map Ast.string_of_vdef (List.rev fdecl.flocals)) ^ "\n"
-          ^ stmt (Block fdecl.fbody) ^ "\n" ^ 
+          then begin
+               add "int main()\n{\n";
+               (if (!profile) then add ("    Tracer::Open(\"./" ^ out_name ^ ".trace.json\");\n"));
+               (* The images read by main start loading with the program, each file once and
+                  unless the program writes it too, and the reads take them when they are reached *)
+               let files = stmt_files (Block fdecl.fbody) in
+               let written = List.map (fun (_, _, p) -> p) (List.filter (fun (r, _, _) -> not r) files) in
+               let prefetched = List.fold_left (fun l (r, i, p) ->
+                   if (r && (List.mem (type_of i) [Image; Gray; FloatImage]) && not (List.mem p written) && not (List.mem p l))
+                   then l @ [p] else l) [] files in
+               List.iter (fun p -> add ("    Image::prefetch(" ^ p ^ ");\n")) prefetched;
+               add ("    g_clProgram.CompileClFile(\"./" ^ out_name ^ ".cl\");\n\n")
+          end
+          else begin
+               add ((vartype fdecl.freturn) ^ " " ^ fdecl.fname);
+               match fdecl.fparams with
+                 first :: rest ->
+                   add ("(" ^ func_params_type first.vtype ^ " " ^ first.vname ^ " ");
+                   List.iter (fun formal -> add (", " ^ func_params_type formal.vtype ^ " " ^ formal.vname)) rest;
+                   add ")\n{\n"
+               | [] -> add "()\n{\n"
+          end);
+          (if (!profile) then add ("TraceScope __sip_fun_trace__(\"fun " ^ fdecl.fname ^ "\", " ^ string_of_int fdecl.fline ^ ");\n"));
+          List.iter (add_cc_vdef b (fdecl.fname ^ ".")) (List.rev fdecl.flocals); add "\n";
+          stmt (Block fdecl.fbody); add "\n";
           if ((String.compare fdecl.fname "main") == 0)
-    	  then "    return 0;\n}\n"
-          else "\n}\n"
+    	  then add "    return Image::flush();\n}\n"
+          else add "\n}\n"
       end
 
   in let env = { 
@@ -254,77 +625,116 @@ let translate_to_cc (globals, functions) out_name =
   with Not_found -> raise (Failure ("no \"main\" function"))
     
   (* Compile the functions *)
-  in cc_headers ^
-    String.concat "" (List.map Ast.string_of_vdef (List.rev globals)) ^ "\n" ^
-	(String.concat "\n" (List.map (translate env) (List.rev functions))) ^ "\n"
+  in add cc_headers;
+    add_typed_temps (); add "\n";
+    List.iter (add_cc_vdef b "") (List.rev globals); add "\n";
+	Ast.add_list b "\n" (translate env) (List.rev functions); add "\n";
+	Buffer.contents b
 
 (* Translate the AST tree into a OpenCL shader program *)
 let translate_to_cl (globals, functions) out_name =
 
   (* Keep track of global variables *)
   let function_decls = string_map_pairs StringMap.empty (enum_func functions) in
+  let b = Buffer.create 65536 in
 
   (* Translate a function in AST form into a C++ statements *)
   let translate env fdecl =
     let local_var = enum_vdef fdecl.flocals
     and formal_var = enum_vdecl fdecl.fparams in
     let env = { env with local_var = string_map_pairs StringMap.empty (local_var @ formal_var) } in
+    let consts = ref StringMap.empty in (* Counters of the loops being unrolled *)
+    let input = (match fdecl.fparams with p :: _ -> p.vname | [] -> "") in
+
+    (* Rows and columns offsets read from the input image, used by the runtime for tiling and borders *)
+    let stencil = ref (0, 0, 0, 0) in
+    let stencil_known = ref true in
+
+    (* The body is emitted apart, the kernel header needs the stencil footprint known only after it *)
+    let body = Buffer.create 4096 in
+    let add s = Buffer.add_string body s in
 
     let rec expr e = 
 	  (match e with
-      BoolLiteral(l) -> string_of_bool l
-      | IntLiteral(l) -> string_of_int l
-      | FloatLiteral(l) -> string_of_float l
-      | StringLiteral(l) -> l
+      BoolLiteral(l) -> add (string_of_bool l)
+      | IntLiteral(l) -> add (string_of_int l)
+      | FloatLiteral(l) -> add (string_of_float l)
+      | StringLiteral(l) -> add l
       | Id(s) -> 
-		  if (StringMap.mem s env.local_var)
-            then s
+		  if (StringMap.mem s !consts)
+		    then (let n = StringMap.find s !consts in
+		          add (if (n < 0) then "(" ^ string_of_int n ^ ")" else string_of_int n))
+		  else if (StringMap.mem s env.local_var)
+            then add s
 			else raise (Failure ("undeclared variable " ^ s))
       | Unop(o, e) ->
-          (match o with
-        Neg -> "-") ^ expr e
+          add (match o with
+        Neg -> "-"); expr e
       | Binop (e1, op, e2) -> 
-		  expr e1 ^ " " ^
-          (match op with
-	    Add -> "+" | Sub -> "-" | Mult -> "*" | Div -> "/" | Mod -> "%"
-          | Neq -> "!=" | Lt -> "<" | Leq -> "<=" | Gt -> ">" | Geq -> ">=" | Eq -> "=="
-          | And -> "&&" | Or -> "||" | Not -> "!"
-          | BitAnd -> "&" | BitOr -> "|" | BitNot -> "~") ^ " " ^
-          expr e2
+		  expr e1; add (" " ^ Ast.string_of_op op ^ " "); expr e2
       | Assign (s, e) ->
 		  if (StringMap.mem s env.local_var)
-		    then s ^ " = " ^ expr e
+		    then (add (s ^ " = "); expr e)
 		 	else raise (Failure ("undeclared variable " ^ s))
       | Call (fname, actuals) -> raise (Failure ("Function call aren't supported in Kernel function " ^ fname))
-  	  | Ques (e1, e2, e3) -> "(" ^ expr e1 ^ ") ? " ^
-  	      expr e2 ^ ":" ^ expr e3
-      | Bracket (e) -> "(" ^ expr e ^ ")"
-      | Imaccessor (i, r, c, a) -> "read_imagef(" ^ i ^ ", sampler, pos + (int2)(" ^ 
-                                   expr c ^ "," ^ expr r ^ "))." ^ 
-                                   (match a with
-                                       "Red" -> "x"
-                                     | "Green" -> "y"
-                                     | "Blue" -> "z"
-                                     | _ -> raise (Failure ("Invalid channel " ^ a)))
+  	  | Ques (e1, e2, e3) -> add "("; expr e1; add ") ? ";
+  	      expr e2; add ":"; expr e3
+      | Bracket (e) -> add "("; expr e; add ")"
+      | Imaccessor (i, r, c, a) ->
+          let offset e = (match const_int !consts e with
+                             Some n -> add (string_of_int n)
+                           | None -> expr e) in
+          let channel = (match a with
+                            "Red" -> "x"
+                          | "Green" -> "y"
+                          | "Blue" -> "z"
+                          | _ -> raise (Failure ("Invalid channel " ^ a))) in
+          (if ((String.compare i input) == 0) then
+             match (const_int !consts r, const_int !consts c) with
+               (Some dr, Some dc) ->
+                 let (r0, r1, c0, c1) = !stencil in
+                 stencil := (min r0 dr, max r1 dr, min c0 dc, max c1 dc)
+             | _ -> stencil_known := false);
+          add ("read_imagef(" ^ i ^ ", sampler, pos + (int2)(");
+          offset c; add ","; offset r; add ("))." ^ channel)
       | Accessor(i, a) -> raise (Failure ("Accessor is not supported in a kernel function."))
-      | Noexpr -> "")
+      | Noexpr -> ())
 
     in let rec stmt = function
 	    Block(sl) -> 
-          String.concat "" (List.map stmt sl) ^ "\n"
-	  | Expr(e) -> expr e ^ ";\n";
+          List.iter stmt sl; add "\n"
+	  | Expr(e) -> expr e; add ";\n"
 	  | Imexpr(imexpr) -> raise (Failure ("Image expression is not supported in a kernel function."))
 	  | Imread(i, p) -> raise (Failure ("Read operator is not supported in a kernel function."))
-	  | Imwrite(i, p) -> raise (Failure ("Write operator is not supported in a kernel function."))  
-	  | Return(e) -> "return " ^ expr e ^ ";\n";
-	  | If(e, s, Block([])) -> "if (" ^ expr e ^ ")\n{\n" ^ stmt s ^ "}\n"
-      | If(e, s1, s2) ->  "if (" ^ expr e ^ ")\n{\n" ^
-	      stmt s1 ^ "}\nelse\n{\n" ^ stmt s2 ^ "}\n"
+	  | Imwrite(i, p) -> raise (Failure ("Write operator is not supported in a kernel function."))
+	  | Streamread(_, _) | Streamwrite(_, _) -> raise (Failure ("Streams are not supported in a kernel function."))  
+	  | Return(e) -> add "return "; expr e; add ";\n"
+	  | If(e, s, Block([])) -> add "if ("; expr e; add ")\n{\n"; stmt s; add "}\n"
+      | If(e, s1, s2) -> add "if ("; expr e; add ")\n{\n";
+	      stmt s1; add "}\nelse\n{\n"; stmt s2; add "}\n"
 	  | For(e1, e2, e3, s) ->
-	      "for (" ^ expr e1  ^ " ; " ^ expr e2 ^ " ; " ^
-	      expr e3  ^ ") {\n" ^ stmt s ^ "}\n"
-	  | While(e, s) -> "while (" ^ expr e ^ ") " ^ "{\n" ^ stmt s ^ "}\n"
-      | Break -> "break;\n"
+	      (match unroll_range !consts e1 e2 e3 s with
+	         Some (v, values, final) ->
+	           (* Emit one copy of the body per iteration with the counter folded to a constant *)
+	           let saved = !consts in
+	           List.iter (fun n -> consts := StringMap.add v n saved; stmt s) values;
+	           consts := saved;
+	           expr (Assign(v, IntLiteral(final))); add ";\n"
+	       | None ->
+	           add "for ("; expr e1; add " ; "; expr e2; add " ; ";
+	           expr e3; add ") {\n"; stmt s; add "}\n")
+	  | Parfor(_, _, _, _) -> raise (Failure ("parfor is not supported in a kernel function."))
+	  | While(e, s) -> add "while ("; expr e; add ") "; add "{\n"; stmt s; add "}\n"
+      | Break -> add "break;\n"
+      | Located(_, s) -> stmt s
+
+    (* Stencil footprint of the kernel as "rows min max cols min max", unknown if an offset isn't constant *)
+    in let string_of_stencil name =
+      if (!stencil_known) then
+        (let (r0, r1, c0, c1) = !stencil in
+           "// sip:stencil " ^ name ^ " rows " ^ string_of_int r0 ^ " " ^ string_of_int r1 ^
+           " cols " ^ string_of_int c0 ^ " " ^ string_of_int c1 ^ "\n")
+      else ""
 
     (* Return OpenCL specific type only *)
     in let func_params_type = function
@@ -334,19 +744,26 @@ let translate_to_cl (globals, functions) out_name =
   (* Translate only kernel function. *)
   in  if (fdecl.fgpu) then begin
       (if (fdecl.freturn != Void) then raise (Failure ("Kernel function can't return any value."))
+       else if ((List.length fdecl.fparams) != 2) then raise (Failure ("Kernel function must takes 2 image types as argument."))
        else
-          "__kernel void " ^ fdecl.fname
-          ^ if ((List.length fdecl.fparams) != 2) then raise (Failure ("Kernel function must takes 2 image types as argument."))
-            else ("(__read_only "
-          ^ func_params_type (List.hd fdecl.fparams).vtype ^ " " ^ (List.hd fdecl.fparams).vname ^ " "
-          ^ String.concat "" (List.map (fun formal -> ", __write_only " ^ func_params_type formal.vtype ^ " " ^ formal.vname) (List.tl fdecl.fparams)) 
-          ^ ")\n{\n    const int2 pos = {get_global_id(0), get_global_id(1)};\n"
-          ^ String.concat "" (List.map Ast.string_of_vdef (List.rev fdecl.flocals)) ^ "\n"
-          ^ stmt (Block fdecl.fbody) ^ "\n" ^ "    float4 _out_ = {red_out, green_out, blue_out, 0.0f};\n" 
-          ^ "    write_imagef (" ^ (List.hd (List.tl fdecl.fparams)).vname
+          (* The body is translated first, the stencil footprint is known only after that. *)
+          let output = (List.hd (List.tl fdecl.fparams)).vname in
+          stmt (Block fdecl.fbody);
+          Buffer.add_string b (string_of_stencil fdecl.fname
+          ^ "__kernel void " ^ fdecl.fname
+          ^ "(__read_only "
+          ^ func_params_type (List.hd fdecl.fparams).vtype ^ " " ^ (List.hd fdecl.fparams).vname ^ " ");
+          List.iter (fun formal -> Buffer.add_string b (", __write_only " ^ func_params_type formal.vtype ^ " " ^ formal.vname)) (List.tl fdecl.fparams);
+          Buffer.add_string b (")\n{\n    const int2 pos = {get_global_id(0), get_global_id(1)};\n"
+          ^ "    if (pos.x >= get_image_width(" ^ output
+          ^ ") || pos.y >= get_image_height(" ^ output ^ ")) return;\n");
+          List.iter (Ast.add_vdef b) (List.rev fdecl.flocals); Buffer.add_string b "\n";
+          Buffer.add_buffer b body;
+          Buffer.add_string b ("\n" ^ "    float4 _out_ = {red_out, green_out, blue_out, 0.0f};\n" 
+          ^ "    write_imagef (" ^ output
           ^ ", (int2)(pos.x, pos.y), _out_);" ^ "\n}\n"))
       end
-  else ""
+  else ()
   
   in let env = { 
          function_decl = function_decls;
@@ -354,5 +771,6 @@ let translate_to_cl (globals, functions) out_name =
 		 local_var = StringMap.empty }
 
   (* Compile the functions *)
-  in cl_headers ^
-	(String.concat "\n" (List.map (translate env) (List.rev functions))) ^ "\n"
+  in Buffer.add_string b cl_headers;
+	Ast.add_list b "\n" (translate env) (List.rev functions); Buffer.add_string b "\n";
+	Buffer.contents b
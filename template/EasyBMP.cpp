@@ -19,6 +19,7 @@
 *************************************************/
 
 #include "EasyBMP.h"
+#include <algorithm>
 
 /* These functions are defined in EasyBMP.h */
 
@@ -307,6 +308,21 @@ BMP::~BMP()
  { delete [] MetaData2; }
 } 
 
+void BMP::Swap( BMP& Other )
+{
+ std::swap( BitDepth , Other.BitDepth );
+ std::swap( Width , Other.Width );
+ std::swap( Height , Other.Height );
+ std::swap( Pixels , Other.Pixels );
+ std::swap( Colors , Other.Colors );
+ std::swap( XPelsPerMeter , Other.XPelsPerMeter );
+ std::swap( YPelsPerMeter , Other.YPelsPerMeter );
+ std::swap( MetaData1 , Other.MetaData1 );
+ std::swap( SizeOfMetaData1 , Other.SizeOfMetaData1 );
+ std::swap( MetaData2 , Other.MetaData2 );
+ std::swap( SizeOfMetaData2 , Other.SizeOfMetaData2 );
+}
+
 RGBApixel* BMP::operator()(int i, int j)
 {
  using namespace std;
@@ -445,7 +461,6 @@ bool BMP::WriteToFile( const char* FileName )
    cout << "EasyBMP Error: Cannot open file " 
         << FileName << " for output." << endl;
   }
-  fclose( fp );
   return false;
  }
   
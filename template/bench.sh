@@ -0,0 +1,88 @@
+#!/bin/sh
+
+# Benchmark a compiled SIP program on synthetic images.
+#
+# The program runs in ./bench.tmp where ./blackbuck.bmp, the input of the test programs,
+# is replaced by a generated image of each size (in megapixels) and bit depth. One JSON
+# object per line is printed for the whole run and, when the program was compiled with
+# "sip -c -profile", for each traced stage: wall time, MPix/s and peak RSS.
+
+PROGRAM=$1
+NAME=$2
+SIZES=${BENCH_SIZES:-"1 16 100"}
+DEPTHS=${BENCH_DEPTHS:-"8 24 32"}
+WORKDIR=bench.tmp
+
+Usage() {
+    echo "Usage: bench.sh <program> <name>"
+    echo "BENCH_SIZES and BENCH_DEPTHS override the megapixels and bit depths"
+    exit 1
+}
+
+# Seconds since the epoch with the best resolution date offers
+Now() {
+    date +%s.%N | sed 's/\.N$/.0/'
+}
+
+# Report <megapixels> <depth> <seconds>
+# Print the whole run and the stages found in the trace as JSON lines
+Report() {
+    awk -v program="$NAME" -v mp="$1" -v depth="$2" -v total="$3" '
+        /"ph":"X"/ {
+            match($0, /"name":"[^"]*"/);   name = substr($0, RSTART + 8, RLENGTH - 9)
+            match($0, /"dur":[0-9.]+/);     dur  = substr($0, RSTART + 6, RLENGTH - 6)
+            match($0, /"line":[0-9]+/);     line = substr($0, RSTART + 7, RLENGTH - 7)
+            match($0, /"maxrss_kb":[0-9]+/); rss = substr($0, RSTART + 12, RLENGTH - 12)
+            key = line SUBSEP name
+            stages[key] = 1
+            calls[key]++
+            ms[key] += dur / 1000.0
+            if (rss + 0 > peak[key]) peak[key] = rss + 0
+            if (rss + 0 > maxrss) maxrss = rss + 0
+        }
+        function record(stage, line, n, t, rss) {
+            printf "{\"program\":\"%s\",\"megapixels\":%s,\"depth\":%s,\"stage\":\"%s\",\"line\":%d,", program, mp, depth, stage, line
+            printf "\"calls\":%d,\"wall_ms\":%.3f,\"mpix_per_s\":%.2f,\"peak_rss_kb\":%s}\n", n, t, (t > 0) ? mp / (t / 1000.0) : 0, rss
+        }
+        END {
+            record("total", 0, 1, total * 1000.0, (maxrss > 0) ? maxrss : "null")
+            for (key in stages) {
+                split(key, part, SUBSEP)
+                record(part[2], part[1], calls[key], ms[key], peak[key])
+            }
+        }' trace.json
+}
+
+[ -x "$PROGRAM" ] || Usage
+[ -n "$NAME" ] || Usage
+
+rm -rf $WORKDIR
+mkdir -p $WORKDIR
+cp "$PROGRAM" $WORKDIR/program
+[ -f ${NAME}.cl ] && cp ${NAME}.cl $WORKDIR/
+
+cd $WORKDIR
+
+for mp in $SIZES
+do
+    side=`awk "BEGIN { printf \"%d\", sqrt($mp * 1000000) }"`
+
+    for depth in $DEPTHS
+    do
+        ../genbmp ./blackbuck.bmp $side $side $depth || exit 1
+        rm -f trace.json
+        touch trace.json
+
+        start=`Now`
+        SIP_TRACE_FILE=./trace.json ./program > program.out 2>&1 || {
+            echo "$NAME failed on ${mp}MP ${depth}-bit" 1>&2
+            continue
+        }
+        end=`Now`
+
+        Report $mp $depth `awk "BEGIN { print $end - $start }"`
+    done
+done
+
+cd ..
+rm -rf $WORKDIR
@@ -0,0 +1,129 @@
+/*
+    Columbia University
+
+    PLT 4115 Course - SIP Compiler Project
+
+    Under the Supervision of: Prof. Stephen A. Edwards
+    Name: Emad Barsoum
+    UNI: eb2871
+
+    genbmp.cpp, writes synthetic BMP images for the benchmarks.
+
+    Usage: genbmp <file> <width> <height> <8|24|32>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void put16(unsigned char* p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char* p, unsigned int v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 5)
+    {
+        printf("Usage: genbmp <file> <width> <height> <8|24|32>\n");
+        return 1;
+    }
+
+    unsigned int width  = atoi(argv[2]);
+    unsigned int height = atoi(argv[3]);
+    unsigned int depth  = atoi(argv[4]);
+
+    if ((width == 0) || (height == 0) || ((depth != 8) && (depth != 24) && (depth != 32)))
+    {
+        printf("Invalid size or bit depth\n");
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "wb");
+    if (!file)
+    {
+        printf("Couldn't open: %s\n", argv[1]);
+        return 1;
+    }
+
+    // Rows are padded to 4 bytes, 8-bit images carry a 256 entries gray palette.
+    unsigned int rowSize = (width * depth / 8 + 3) & ~3u;
+    unsigned int paletteSize = (depth == 8) ? 256 * 4 : 0;
+    unsigned int offset = 14 + 40 + paletteSize;
+
+    unsigned char header[54];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    put32(header + 2, offset + rowSize * height);
+    put32(header + 10, offset);
+    put32(header + 14, 40);
+    put32(header + 18, width);
+    put32(header + 22, height);
+    put16(header + 26, 1);
+    put16(header + 28, depth);
+    put32(header + 34, rowSize * height);
+    put32(header + 38, 2835);
+    put32(header + 42, 2835);
+    put32(header + 46, (depth == 8) ? 256 : 0);
+    fwrite(header, 1, sizeof(header), file);
+
+    if (depth == 8)
+    {
+        unsigned char palette[256 * 4];
+        for (unsigned int i = 0; i < 256; ++i)
+        {
+            palette[4 * i] = palette[4 * i + 1] = palette[4 * i + 2] = i;
+            palette[4 * i + 3] = 0;
+        }
+        fwrite(palette, 1, sizeof(palette), file);
+    }
+
+    // Gradients with a xor texture, so filters and thresholds have edges to work on.
+    unsigned char* row = new unsigned char[rowSize];
+    memset(row, 0, rowSize);
+
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        for (unsigned int x = 0; x < width; ++x)
+        {
+            unsigned char red   = (unsigned char)(x * 255 / width);
+            unsigned char green = (unsigned char)(y * 255 / height);
+            unsigned char blue  = (unsigned char)((x ^ y) & 0xFF);
+
+            switch (depth)
+            {
+                case 8:
+                row[x] = (unsigned char)((red + green + blue) / 3);
+                break;
+
+                case 24:
+                row[3 * x    ] = blue;
+                row[3 * x + 1] = green;
+                row[3 * x + 2] = red;
+                break;
+
+                case 32:
+                row[4 * x    ] = blue;
+                row[4 * x + 1] = green;
+                row[4 * x + 2] = red;
+                row[4 * x + 3] = 0xFF;
+                break;
+            }
+        }
+
+        fwrite(row, 1, rowSize, file);
+    }
+
+    delete[] row;
+    fclose(file);
+
+    return 0;
+}
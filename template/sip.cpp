@@ -14,17 +14,27 @@
 
 using namespace Sip;
 
-ClProgram::ClProgram() :  _commandQueue(NULL),
-                          _deviceId(NULL),
-                          _context(NULL),
-                          _program(NULL),
-                          _platformId(NULL)
+static double Now()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+ClProgram::ClProgram() :  _tuning(true),
+                          _tuningLoaded(false),
+                          _profiling(false)
 {
     Init();
 }
 
 ClProgram::~ClProgram()
 {
+    if (_profiling)
+    {
+        Report();
+    }
+
     Uninit();
 }
 
@@ -34,56 +44,154 @@ void ClProgram::Init()
     cl_uint platformCount = 0;
     cl_uint deviceCount = 0;
 
-    ret = clGetPlatformIDs(1, &_platformId, &platformCount);
-    if (ret != CL_SUCCESS) 
+    const char* tuning = getenv("SIP_TUNING");
+    _tuning = (tuning == NULL) || (strcmp(tuning, "0") != 0);
+
+    // SIP_PROFILE=1 enables OpenCL event profiling and prints a per statement report at exit.
+    const char* profile = getenv("SIP_PROFILE");
+    _profiling = (profile != NULL) && (strcmp(profile, "0") != 0);
+
+    // By default only the first GPU is used, SIP_DEVICES=all splits every launch across
+    // all the OpenCL devices of all the platforms, CPU devices included.
+    const char* devices = getenv("SIP_DEVICES");
+    if ((devices == NULL) || (strcmp(devices, "all") != 0))
     {
-        cout << "Error: clGetPlatformIDs: " << ret << endl;
+        cl_platform_id platformId = NULL;
+        cl_device_id deviceId = NULL;
+
+        ret = clGetPlatformIDs(1, &platformId, &platformCount);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: clGetPlatformIDs: " << ret << endl;
+            return;
+        }
+
+        ret = clGetDeviceIDs(platformId, CL_DEVICE_TYPE_GPU, 1, &deviceId, &deviceCount);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: clGetDeviceIDs: " << ret << endl;
+            return;
+        }
+
+        InitDevice(platformId, deviceId);
         return;
     }
 
-    ret = clGetDeviceIDs(_platformId, CL_DEVICE_TYPE_GPU, 1, &_deviceId, &deviceCount);
-    if (ret != CL_SUCCESS) 
+    ret = clGetPlatformIDs(0, NULL, &platformCount);
+    if ((ret != CL_SUCCESS) || (platformCount == 0))
     {
-        cout << "Error: clGetDeviceIDs: " << ret << endl;
+        cout << "Error: clGetPlatformIDs: " << ret << endl;
         return;
     }
 
-    _context = clCreateContext(NULL, 1, &_deviceId, NULL, NULL, &ret);
+    vector<cl_platform_id> platforms(platformCount);
+    clGetPlatformIDs(platformCount, &platforms[0], NULL);
+
+    for (cl_uint p = 0; p < platformCount; ++p)
+    {
+        if ((clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS) ||
+            (deviceCount == 0))
+        {
+            continue;
+        }
+
+        vector<cl_device_id> ids(deviceCount);
+        clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, deviceCount, &ids[0], NULL);
+
+        for (cl_uint d = 0; d < deviceCount; ++d)
+        {
+            cl_bool images = CL_FALSE;
+            clGetDeviceInfo(ids[d], CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images, NULL);
+            if (images)
+            {
+                InitDevice(platforms[p], ids[d]);
+            }
+        }
+    }
+
+    if (_devices.empty())
+    {
+        cout << "Error: no OpenCL device with image support" << endl;
+    }
+}
+
+bool ClProgram::InitDevice(cl_platform_id platformId, cl_device_id deviceId)
+{
+    cl_int ret = 0;
+    ClDevice device;
+
+    device.platformId   = platformId;
+    device.deviceId     = deviceId;
+    device.program      = NULL;
+    device.measured     = false;
+
+    device.context = clCreateContext(NULL, 1, &deviceId, NULL, NULL, &ret);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clCreateContext: " << ret << endl;
-        return;
+        return false;
     }
 
-    _commandQueue =  clCreateCommandQueue(_context, _deviceId, 0, &ret);
+    device.commandQueue = clCreateCommandQueue(device.context, deviceId,
+                                               _profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &ret);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clCreateCommandQueue: " << ret << endl;
 
-        clReleaseContext(_context);
-        _context = NULL;
-        return;
+        clReleaseContext(device.context);
+        return false;
     }
+
+    char name[256] = {0};
+    clGetDeviceInfo(deviceId, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    device.name = name;
+
+    // Until a launch is measured, assume the throughput scales with compute units and clock.
+    cl_uint units = 1;
+    cl_uint clock = 1;
+    clGetDeviceInfo(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+    clGetDeviceInfo(deviceId, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+    device.throughput = (double)units * clock;
+
+    _devices.push_back(device);
+    return true;
 }
 
 void ClProgram::Uninit()
 {
-    if (_program != NULL)
+    for (size_t i = 0; i < _devices.size(); ++i)
     {
-        clReleaseProgram(_program);
-        _program = NULL;
-    }
+        if (_devices[i].program != NULL)
+        {
+            clReleaseProgram(_devices[i].program);
+        }
 
-    if (_commandQueue != NULL)
-    {
-        clReleaseCommandQueue(_commandQueue);
-        _commandQueue = NULL;
+        clReleaseCommandQueue(_devices[i].commandQueue);
+        clReleaseContext(_devices[i].context);
     }
 
-    if (_context != NULL)
+    _devices.clear();
+}
+
+// Collect the "// sip:stencil <kernel> rows <min> <max> cols <min> <max>" lines emitted by
+// the compiler in front of each kernel.
+void ClProgram::ParseStencils(const char* source)
+{
+    const char* tag = "// sip:stencil ";
+    const char* line = strstr(source, tag);
+
+    while (line != NULL)
     {
-        clReleaseContext(_context);
-        _context = NULL;
+        char name[256];
+        Stencil stencil;
+
+        if (sscanf(line + strlen(tag), "%255s rows %d %d cols %d %d", name,
+                   &stencil.rowMin, &stencil.rowMax, &stencil.colMin, &stencil.colMax) == 5)
+        {
+            _stencils[name] = stencil;
+        }
+
+        line = strstr(line + strlen(tag), tag);
     }
 }
 
@@ -101,380 +209,3909 @@ void ClProgram::CompileClFile(const char* filename)
         return;
     }
 
-    source = new char[MAX_SOURCE_SIZE];
+    source = new char[MAX_SOURCE_SIZE + 1];
     size = fread(source, 1, MAX_SOURCE_SIZE, file);
+    source[size] = '\0';
 
-    if (_program != NULL)
-    {
-        clReleaseProgram(_program);
-        _program = NULL;
-    }
+    ParseStencils(source);
 
-	_program = clCreateProgramWithSource(_context, 1, (const char **)&source, 0, &ret);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: clCreateProgramWithSource :" << ret << endl;
-        return;
-    }
- 
-	ret = clBuildProgram(_program, 1, &_deviceId, NULL, NULL, NULL);
-    if ((ret != CL_SUCCESS) || (ret == CL_BUILD_PROGRAM_FAILURE))
+    for (size_t i = 0; i < _devices.size(); ++i)
     {
-        cout << "Error: clBuildProgram: " << ret << endl;
-        return;
+        ClDevice& device = _devices[i];
+
+        if (device.program != NULL)
+        {
+            clReleaseProgram(device.program);
+            device.program = NULL;
+        }
+
+        device.program = clCreateProgramWithSource(device.context, 1, (const char **)&source, 0, &ret);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: clCreateProgramWithSource :" << ret << endl;
+            continue;
+        }
+
+        ret = clBuildProgram(device.program, 1, &device.deviceId, NULL, NULL, NULL);
+        if ((ret != CL_SUCCESS) || (ret == CL_BUILD_PROGRAM_FAILURE))
+        {
+            cout << "Error: clBuildProgram: " << device.name << ": " << ret << endl;
+            continue;
+        }
     }
 
     delete[] source;
     fclose(file);
 }
 
-void ClProgram::RunKernel(Image& in_image, Image& out_image, const char* kernelName)
+void ClProgram::RunKernel(Image& in_image, Image& out_image, const char* kernelName, int line)
 {
-    cl_int ret = 0;
-	cl_image_format img_fmt;
- 
-	img_fmt.image_channel_order = CL_RGBA;
-	img_fmt.image_channel_data_type = CL_UNORM_INT8;
- 
-	cl_mem imageSrc; 
-    cl_mem imageDst;
- 
-	size_t width = in_image.width();
-    size_t height = in_image.height();
+    Execute(in_image, out_image, kernelName, NULL, line);
+}
 
-	char* input  = new char[width * height * 4];
-	char* output = new char[width * height * 4];
+void ClProgram::ApplyFilter(Image& in_image, Image& out_image, float* filter, int line)
+{
+    Execute(in_image, out_image, "apply_filter", filter, line);
+}
 
-    out_image.clone(in_image);
+void ClProgram::RunKernel(Gray& in_image, Gray& out_image, const char* kernelName, int line)
+{
+    Execute(in_image, out_image, kernelName, NULL, line);
+}
 
-    for (size_t row = 0; row < height; ++row)
-    {
-        for (size_t col = 0; col < width; ++col)
-        {
-            input[row * 4 * width + 4 * col    ] = (char)in_image(row, col)->Red;
-            input[row * 4 * width + 4 * col + 1] = (char)in_image(row, col)->Green;
-            input[row * 4 * width + 4 * col + 2] = (char)in_image(row, col)->Blue;
-            input[row * 4 * width + 4 * col + 3] = (char)in_image(row, col)->Alpha;
-        }
-    }
+void ClProgram::ApplyFilter(Gray& in_image, Gray& out_image, float* filter, int line)
+{
+    Execute(in_image, out_image, "apply_filter", filter, line);
+}
 
-    imageSrc = clCreateImage2D(_context, CL_MEM_READ_ONLY, &img_fmt, width, height, 0, 0, &ret);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: imageSrc clCreateImage2D: " << ret << endl;
-        return;
-    }
- 
-	imageDst = clCreateImage2D(_context, CL_MEM_READ_WRITE, &img_fmt, width, height, 0, 0, &ret);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: imageDst clCreateImage2D: " << ret << endl;
-        return;
-    }
- 
-	cl_event clevent[5];
- 
-	size_t origin[] = {0, 0, 0}; // Defines the offset in pixels in the image from where to write.
-	size_t region[] = {width, height, 1}; // Size of object to be transferred
-	ret = clEnqueueWriteImage(_commandQueue, imageSrc, CL_TRUE, origin, region, 0, 0, input, 0, NULL, &clevent[0]);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: clEnqueueWriteImage: " << ret << endl;
-        return;
-    }
+void ClProgram::RunKernel(FloatImage& in_image, FloatImage& out_image, const char* kernelName, int line)
+{
+    Execute(in_image, out_image, kernelName, NULL, line);
+}
 
-	cl_kernel kernel = clCreateKernel(_program, kernelName, &ret);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: clCreateKernel: " << ret << endl;
-        return;
-    } 
- 
-	ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&imageSrc);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: clSetKernelArg: " << ret << endl;
-        return;
-    }
+void ClProgram::ApplyFilter(FloatImage& in_image, FloatImage& out_image, float* filter, int line)
+{
+    Execute(in_image, out_image, "apply_filter", filter, line);
+}
 
-	ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&imageDst);
-    if (ret != CL_SUCCESS) 
+void ClProgram::RunKernel(ImageArray& in_images, ImageArray& out_images, const char* kernelName, int line)
+{
+    ExecuteBatch(in_images, out_images, kernelName, NULL, line);
+}
+
+void ClProgram::ApplyFilter(ImageArray& in_images, ImageArray& out_images, float* filter, int line)
+{
+    ExecuteBatch(in_images, out_images, "apply_filter", filter, line);
+}
+
+// Split the output rows between the devices in proportion to their throughput. Each band
+// uploads the extra input rows its kernel reads above and below, given by the stencil.
+// Kernels without stencil metadata run whole on the first device.
+void ClProgram::Split(const char* kernelName, size_t height, vector<Band>& bands)
+{
+    map<string, Stencil>::iterator it = _stencils.find(kernelName);
+    size_t count = _devices.size();
+
+    if ((count == 1) || (it == _stencils.end()) || (height < count * MIN_BAND_ROWS))
     {
-        cout << "Error: clSetKernelArg: " << ret << endl;
+        Band band;
+        band.device = 0;
+        band.first  = 0;
+        band.last   = height;
+        band.top    = 0;
+        band.bottom = height;
+        bands.push_back(band);
         return;
     }
 
-	size_t GWSize[] = {width, height, 1};
-	ret = clEnqueueNDRangeKernel(_commandQueue, kernel, 2, NULL, GWSize, NULL, 1, clevent, &clevent[1]);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: clEnqueueNDRangeKernel: " << ret << endl;
-        return;
-    } 
+    size_t haloTop    = (it->second.rowMin < 0) ? -it->second.rowMin : 0;
+    size_t haloBottom = (it->second.rowMax > 0) ?  it->second.rowMax : 0;
 
-    ret = clEnqueueReadImage(_commandQueue, imageDst, CL_TRUE, origin, region, 0, 0, output, 2, clevent, &clevent[2]);
-    if (ret != CL_SUCCESS) 
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i)
     {
-        cout << "Error: clEnqueueReadImage: " << ret << endl;
-        return;
-    } 
+        total += _devices[i].throughput;
+    }
 
-    for (size_t row = 0; row < height; ++row)
+    size_t first = 0;
+    for (size_t i = 0; (i < count) && (first < height); ++i)
     {
-        for (size_t col = 0; col < width; ++col)
+        size_t rows = (size_t)(height * _devices[i].throughput / total);
+        if ((i == count - 1) || (first + rows > height))
         {
-            out_image(row, col)->Red   = output[row * 4 * width + 4 * col    ];
-            out_image(row, col)->Green = output[row * 4 * width + 4 * col + 1];
-            out_image(row, col)->Blue  = output[row * 4 * width + 4 * col + 2];
-            out_image(row, col)->Alpha = output[row * 4 * width + 4 * col + 3];
+            rows = height - first;
+        }
+
+        if (rows == 0)
+        {
+            continue;
         }
-    }
 
-    delete[] input;
-    delete[] output;
+        Band band;
+        band.device = i;
+        band.first  = first;
+        band.last   = first + rows;
+        band.top    = (first > haloTop) ? first - haloTop : 0;
+        band.bottom = (band.last + haloBottom < height) ? band.last + haloBottom : height;
+        bands.push_back(band);
 
-    clReleaseMemObject(imageDst);
-    clReleaseMemObject(imageSrc);
-    clReleaseKernel(kernel);
+        first += rows;
+    }
 }
 
-void ClProgram::ApplyFilter(Image& in_image, Image& out_image, float* filter)
+// Bytes of an RGBA pixel of the given channel type, CL_UNORM_INT8 or CL_FLOAT.
+static size_t PixelBytes(cl_channel_type type)
 {
-    cl_int ret = 0;
-	cl_image_format img_fmt;
- 
-	img_fmt.image_channel_order = CL_RGBA;
-	img_fmt.image_channel_data_type = CL_UNORM_INT8;
- 
-	cl_mem imageSrc; 
-    cl_mem imageDst;
-	cl_mem imageFilter;
- 
-	size_t width = in_image.width();
-    size_t height = in_image.height();
-
-	char* input  = new char[width * height * 4];
-	char* output = new char[width * height * 4];
-	float* filterWeights = new float[9];
+    return (type == CL_FLOAT) ? 4 * sizeof(float) : 4;
+}
 
-	memcpy((void*)filterWeights, (const void*)filter, 9 * sizeof(float));
+// Enqueue the upload, the kernel and the read back of one band without waiting for them.
+bool ClProgram::EnqueueBand(Band& band, const char* kernelName, float* filter, cl_channel_type type,
+                            const char* input, char* output, size_t width)
+{
+    cl_int ret = 0;
+    cl_image_format img_fmt;
+    ClDevice& device = _devices[band.device];
+    size_t pixel = PixelBytes(type);
 
-    out_image.clone(in_image);
+    img_fmt.image_channel_order = CL_RGBA;
+    img_fmt.image_channel_data_type = type;
 
-    for (size_t row = 0; row < height; ++row)
-    {
-        for (size_t col = 0; col < width; ++col)
-        {
-            input[row * 4 * width + 4 * col    ] = (char)in_image(row, col)->Red;
-            input[row * 4 * width + 4 * col + 1] = (char)in_image(row, col)->Green;
-            input[row * 4 * width + 4 * col + 2] = (char)in_image(row, col)->Blue;
-            input[row * 4 * width + 4 * col + 3] = (char)in_image(row, col)->Alpha;
-        }
-    }
+    size_t rows = band.bottom - band.top;
 
-    imageSrc = clCreateImage2D(_context, CL_MEM_READ_ONLY, &img_fmt, width, height, 0, 0, &ret);
+    band.imageSrc = clCreateImage2D(device.context, CL_MEM_READ_ONLY, &img_fmt, width, rows, 0, 0, &ret);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: imageSrc clCreateImage2D: " << ret << endl;
-        return;
+        return false;
     }
- 
-	imageDst = clCreateImage2D(_context, CL_MEM_READ_WRITE, &img_fmt, width, height, 0, 0, &ret);
+
+    band.imageDst = clCreateImage2D(device.context, CL_MEM_READ_WRITE, &img_fmt, width, rows, 0, 0, &ret);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: imageDst clCreateImage2D: " << ret << endl;
-        return;
-    }
- 
-    imageFilter = clCreateBuffer(_context, CL_MEM_READ_ONLY, 9 * sizeof(float), 0, &ret);
-    if (ret != CL_SUCCESS) 
-    {
-        cout << "Error: imageFilter clCreateBuffer: " << ret << endl;
-        return;
+        return false;
     }
- 
-	cl_event clevent[5];
- 
-	size_t origin[] = {0, 0, 0}; // Defines the offset in pixels in the image from where to write.
-	size_t region[] = {width, height, 1}; // Size of object to be transferred
-	ret = clEnqueueWriteImage(_commandQueue, imageSrc, CL_TRUE, origin, region, 0, 0, input, 0, NULL, &clevent[0]);
+
+    size_t origin[] = {0, 0, 0}; // Defines the offset in pixels in the image from where to write.
+    size_t region[] = {width, rows, 1}; // Size of object to be transferred
+    ret = clEnqueueWriteImage(device.commandQueue, band.imageSrc, CL_FALSE, origin, region, 0, 0,
+                              input + band.top * width * pixel, 0, NULL, &band.events[band.eventCount]);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clEnqueueWriteImage: " << ret << endl;
-        return;
+        return false;
     }
+    band.eventCount++;
 
-    ret = clEnqueueWriteBuffer(_commandQueue, imageFilter, CL_TRUE, 0, 9 * sizeof(float), filterWeights, 0, NULL, &clevent[1]);
-    if (ret != CL_SUCCESS) 
+    if (filter != NULL)
     {
-        cout << "Error: clEnqueueWriteBuffer: " << ret << endl;
-        return;
+        band.imageFilter = clCreateBuffer(device.context, CL_MEM_READ_ONLY, 9 * sizeof(float), 0, &ret);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: imageFilter clCreateBuffer: " << ret << endl;
+            return false;
+        }
+
+        ret = clEnqueueWriteBuffer(device.commandQueue, band.imageFilter, CL_FALSE, 0, 9 * sizeof(float),
+                                   filter, 0, NULL, &band.events[band.eventCount]);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: clEnqueueWriteBuffer: " << ret << endl;
+            return false;
+        }
+        band.eventCount++;
     }
 
-	cl_kernel kernel = clCreateKernel(_program, "apply_filter", &ret);
+    band.kernel = clCreateKernel(device.program, kernelName, &ret);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clCreateKernel: " << ret << endl;
-        return;
+        return false;
     } 
- 
-	ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&imageSrc);
+
+    ret = clSetKernelArg(band.kernel, 0, sizeof(cl_mem), (void *)&band.imageSrc);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clSetKernelArg imageSrc: " << ret << endl;
-        return;
+        return false;
     }
 
-	ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&imageDst);
+    ret = clSetKernelArg(band.kernel, 1, sizeof(cl_mem), (void *)&band.imageDst);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clSetKernelArg imageDst: " << ret << endl;
-        return;
+        return false;
     }
 
-	ret = clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&imageFilter);
-    if (ret != CL_SUCCESS) 
+    if (filter != NULL)
     {
-        cout << "Error: clSetKernelArg filter: " << ret << endl;
-        return;
+        ret = clSetKernelArg(band.kernel, 2, sizeof(cl_mem), (void *)&band.imageFilter);
+        if (ret != CL_SUCCESS) 
+        {
+            cout << "Error: clSetKernelArg filter: " << ret << endl;
+            return false;
+        }
     }
 
-	size_t GWSize[] = {width, height, 1};
-	ret = clEnqueueNDRangeKernel(_commandQueue, kernel, 2, NULL, GWSize, NULL, 1, clevent, &clevent[2]);
+    ret = Launch(device, band.kernel, kernelName, width, rows, band.eventCount, band.events, &band.events[band.eventCount]);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clEnqueueNDRangeKernel: " << ret << endl;
-        return;
+        return false;
     } 
+    band.eventCount++;
 
-    ret = clEnqueueReadImage(_commandQueue, imageDst, CL_TRUE, origin, region, 0, 0, output, 2, clevent, &clevent[3]);
+    // Only the band's own rows are read back, the halo rows were clamped at the band edges.
+    origin[1] = band.first - band.top;
+    region[1] = band.last - band.first;
+    ret = clEnqueueReadImage(device.commandQueue, band.imageDst, CL_FALSE, origin, region, 0, 0,
+                             output + band.first * width * pixel, 1, &band.events[band.eventCount - 1],
+                             &band.events[band.eventCount]);
     if (ret != CL_SUCCESS) 
     {
         cout << "Error: clEnqueueReadImage: " << ret << endl;
-        return;
+        return false;
     } 
+    band.eventCount++;
 
-    for (size_t row = 0; row < height; ++row)
-    {
-        for (size_t col = 0; col < width; ++col)
-        {
-            out_image(row, col)->Red   = output[row * 4 * width + 4 * col    ];
-            out_image(row, col)->Green = output[row * 4 * width + 4 * col + 1];
-            out_image(row, col)->Blue  = output[row * 4 * width + 4 * col + 2];
-            out_image(row, col)->Alpha = output[row * 4 * width + 4 * col + 3];
-        }
-    }
-
-    delete[] filterWeights;
-    delete[] input;
-    delete[] output;
-
-    clReleaseMemObject(imageDst);
-    clReleaseMemObject(imageSrc);
-    clReleaseKernel(kernel);
+    clFlush(device.commandQueue);
+    return true;
 }
 
-Image::Image()
-{}
+void ClProgram::Execute(Image& in_image, Image& out_image, const char* kernelName, float* filter, int line)
+{
+	size_t width = in_image.width();
+    size_t height = in_image.height();
 
-Image::Image(const Image& img) : _image(const_cast<BMP&>(img._image))
-{}
+    out_image.clone(in_image);
 
-void Image::read(const char* path)
-{
-    _image.ReadFromFile(path);
+    Dispatch(width, height, CL_UNORM_INT8,
+             [&](char* input)
+             {
+                 for (size_t row = 0; row < height; ++row)
+                 {
+                     for (size_t col = 0; col < width; ++col)
+                     {
+                         input[row * 4 * width + 4 * col    ] = (char)in_image(row, col)->Red;
+                         input[row * 4 * width + 4 * col + 1] = (char)in_image(row, col)->Green;
+                         input[row * 4 * width + 4 * col + 2] = (char)in_image(row, col)->Blue;
+                         input[row * 4 * width + 4 * col + 3] = (char)in_image(row, col)->Alpha;
+                     }
+                 }
+             },
+             [&](const char* output)
+             {
+                 for (size_t row = 0; row < height; ++row)
+                 {
+                     for (size_t col = 0; col < width; ++col)
+                     {
+                         out_image(row, col)->Red   = output[row * 4 * width + 4 * col    ];
+                         out_image(row, col)->Green = output[row * 4 * width + 4 * col + 1];
+                         out_image(row, col)->Blue  = output[row * 4 * width + 4 * col + 2];
+                         out_image(row, col)->Alpha = output[row * 4 * width + 4 * col + 3];
+                     }
+                 }
+             },
+             kernelName, filter, line, in_image.name(), out_image.name());
 }
 
-void Image::write(const char* path)
+// 8 bit value of a float channel, 0 to 1 spanning 0 to 255.
+static inline ebmpBYTE Quantize(float value)
 {
-    _image.WriteToFile(path);
+    return (ebmpBYTE)std::min(std::max(value * 255.0f + 0.5f, 0.0f), 255.0f);
 }
 
-int Image::width()
-{
-    return _image.TellWidth();
-}
-    
-int Image::height()
+// Gray level of a color, the ITU-R BT.601 weights in 8 bit fixed point.
+static inline ebmpBYTE Luma(unsigned red, unsigned green, unsigned blue)
 {
-    return _image.TellHeight();
+    return (ebmpBYTE)((77 * red + 150 * green + 29 * blue + 128) >> 8);
 }
 
-void Image::clone(Image& img)
+void ClProgram::Execute(Gray& in_image, Gray& out_image, const char* kernelName, float* filter, int line)
 {
-	if (this == &img)
-	{
-	    return;
-	}
+    size_t width = in_image.width();
+    size_t height = in_image.height();
 
-	_image.SetSize(img._image.TellWidth(), img._image.TellHeight());
-	_image.SetBitDepth(img._image.TellBitDepth());
+    out_image.clone(in_image);
+
+    Dispatch(width, height, CL_UNORM_INT8,
+             [&](char* input)
+             {
+                 for (size_t row = 0; row < height; ++row)
+                 {
+                     for (size_t col = 0; col < width; ++col)
+                     {
+                         char value = (char)in_image(row, col)->Luma;
+                         input[row * 4 * width + 4 * col    ] = value;
+                         input[row * 4 * width + 4 * col + 1] = value;
+                         input[row * 4 * width + 4 * col + 2] = value;
+                         input[row * 4 * width + 4 * col + 3] = 0;
+                     }
+                 }
+             },
+             [&](const char* output)
+             {
+                 const unsigned char* pixels = (const unsigned char*)output;
+                 for (size_t row = 0; row < height; ++row)
+                 {
+                     for (size_t col = 0; col < width; ++col)
+                     {
+                         const unsigned char* pixel = pixels + row * 4 * width + 4 * col;
+                         out_image(row, col)->Luma = Luma(pixel[0], pixel[1], pixel[2]);
+                     }
+                 }
+             },
+             kernelName, filter, line, in_image.name(), out_image.name());
 }
 
-void Image::copyRangeTo(unsigned int offsetX,
-                        unsigned int offsetY,
-                        unsigned int width,
-                        unsigned int height,
-                        Image& img)
+// The pixels are already row major CL_RGBA floats, so they are the upload and read back
+// buffers. The bands of a launch read rows that other bands write, so an image is never
+// both the input and the output.
+void ClProgram::Execute(FloatImage& in_image, FloatImage& out_image, const char* kernelName, float* filter, int line)
 {
-    if (((offsetX + width) > (unsigned int)_image.TellWidth()) ||
-        ((offsetY + height) > (unsigned int)_image.TellHeight()))
+    if (&in_image == &out_image)
     {
-        cout << "Invalid image range..." << endl;
+        FloatImage copy(in_image.name().c_str());
+        copy = in_image;
+        Execute(copy, out_image, kernelName, filter, line);
         return;
     }
-        
-	img._image.SetSize(width, height);
-	img._image.SetBitDepth(_image.TellBitDepth());
-    
-    for (size_t row = 0; row < height; ++row)
-    {
-        for (size_t col = 0; col < width; ++col)
-        {
-            img(row, col)->Red   = _image(offsetY + row, offsetX + col)->Red;
-            img(row, col)->Green = _image(offsetY + row, offsetX + col)->Green;
-            img(row, col)->Blue  = _image(offsetY + row, offsetX + col)->Blue;
-            img(row, col)->Alpha = _image(offsetY + row, offsetX + col)->Alpha;
-        }
-    }
-}
 
-RGBApixel* Image::operator()(int i,int j)
-{
-    return _image(i, j);
+    out_image.clone(in_image);
+
+    Dispatch(in_image.width(), in_image.height(), CL_FLOAT, nullptr, nullptr,
+             kernelName, filter, line, in_image.name(), out_image.name(),
+             (const char*)in_image(0, 0), (char*)out_image(0, 0));
 }
 
-Image& Image::operator=(Image &rhs)
+// One launch for all the images of a batch. The images are stacked in an atlas, each one
+// surrounded by copies of its edge rows and columns as deep as the kernel's stencil, so that
+// reads past an image edge see the same clamped pixels as on the image alone.
+void ClProgram::ExecuteBatch(ImageArray& in_images, ImageArray& out_images, const char* kernelName,
+                             float* filter, int line)
 {
-	if (this == &rhs)
-	{
-	    return *this;
-	}
-
-	clone(rhs);
+    size_t count = in_images.size();
+    out_images.resize(count);
 
-    for (int row = 0; row < height(); ++row)
+    map<string, Stencil>::iterator it = _stencils.find(kernelName);
+    if (it == _stencils.end())
     {
-        for (int col = 0; col < width(); ++col)
+        // Without a known footprint the padding can't be sized, launch per image.
+        for (size_t i = 0; i < count; ++i)
         {
-            _image(row, col)->Red   = rhs(row, col)->Red;
-            _image(row, col)->Green = rhs(row, col)->Green;
-            _image(row, col)->Blue  = rhs(row, col)->Blue;
-            _image(row, col)->Alpha = rhs(row, col)->Alpha;
+            Execute(in_images[i], out_images[i], kernelName, filter, line);
         }
+        return;
     }
 
-    return *this;
-}
+    size_t top    = (it->second.rowMin < 0) ? -it->second.rowMin : 0;
+    size_t bottom = (it->second.rowMax > 0) ?  it->second.rowMax : 0;
+    size_t right  = (it->second.colMax > 0) ?  it->second.colMax : 0;
 
-Histogram::Histogram()
-{
-    memset((void*)_red, 0, sizeof(_red));
-    memset((void*)_green, 0, sizeof(_green));
-    memset((void*)_blue, 0, sizeof(_blue));
-}
+    // Rows of the atlas where each image starts.
+    vector<size_t> offsets;
+    size_t width = 0;
+    size_t height = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Image& image = in_images[i];
+        width = ((size_t)image.width() + right > width) ? image.width() + right : width;
 
-Histogram::Histogram(Image& img)
+        height += top;
+        offsets.push_back(height);
+        height += image.height() + bottom;
+    }
+
+    if ((width == 0) || (height == 0))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        out_images[i].clone(in_images[i]);
+    }
+
+    Dispatch(width, height, CL_UNORM_INT8,
+             [&](char* input)
+             {
+                 for (size_t i = 0; i < count; ++i)
+                 {
+                     Image& image = in_images[i];
+                     int w = image.width();
+                     int h = image.height();
+                     for (int row = -(int)top; row < h + (int)bottom; ++row)
+                     {
+                         int r = (row < 0) ? 0 : ((row < h) ? row : h - 1);
+                         char* packed = input + (offsets[i] + row) * 4 * width;
+                         for (size_t col = 0; col < width; ++col)
+                         {
+                             RGBApixel* pixel = image(r, ((int)col < w) ? col : w - 1);
+                             packed[4 * col    ] = (char)pixel->Red;
+                             packed[4 * col + 1] = (char)pixel->Green;
+                             packed[4 * col + 2] = (char)pixel->Blue;
+                             packed[4 * col + 3] = (char)pixel->Alpha;
+                         }
+                     }
+                 }
+             },
+             [&](const char* output)
+             {
+                 for (size_t i = 0; i < count; ++i)
+                 {
+                     Image& image = out_images[i];
+                     for (int row = 0; row < image.height(); ++row)
+                     {
+                         const char* result = output + (offsets[i] + row) * 4 * width;
+                         for (int col = 0; col < image.width(); ++col)
+                         {
+                             image(row, col)->Red   = result[4 * col    ];
+                             image(row, col)->Green = result[4 * col + 1];
+                             image(row, col)->Blue  = result[4 * col + 2];
+                             image(row, col)->Alpha = result[4 * col + 3];
+                         }
+                     }
+                 }
+             },
+             kernelName, filter, line, in_images.name(), out_images.name());
+}
+
+// Pack the input into a width x height RGBA staging buffer of the channel type, run the
+// kernel over it on the devices and unpack the result. Images whose pixels already have the
+// device layout give them as the source and target instead, and nothing is staged.
+void ClProgram::Dispatch(size_t width, size_t height, cl_channel_type type, const function<void(char*)>& packInput,
+                         const function<void(const char*)>& unpackOutput, const char* kernelName,
+                         float* filter, int line, const string& inName, const string& outName,
+                         const char* source, char* target)
+{
+    if (_devices.empty())
+    {
+        cout << "Error: no OpenCL device" << endl;
+        return;
+    }
+
+    size_t pixel = PixelBytes(type);
+    size_t staging = width * height * pixel;
+	char* input  = (source == NULL) ? new char[staging] : NULL;
+	char* output = (target == NULL) ? new char[staging] : target;
+    if (source == NULL) Memory::Allocate(Memory::Staging, inName, staging);
+    if (target == NULL) Memory::Allocate(Memory::Staging, outName, staging);
+
+    double pack = Now();
+    if (source == NULL)
+    {
+        packInput(input);
+        source = input;
+    }
+    pack = Now() - pack;
+
+    // The device state, tuning and profiles are shared by concurrent parfor iterations.
+    unique_lock<mutex> lock(_lock);
+
+    vector<Band> bands;
+    Split(kernelName, height, bands);
+
+    double start = Now();
+    size_t pending = 0;
+    bool complete = true;
+    for (size_t i = 0; i < bands.size(); ++i)
+    {
+        Band& band = bands[i];
+        band.imageSrc    = NULL;
+        band.imageDst    = NULL;
+        band.imageFilter = NULL;
+        band.kernel      = NULL;
+        band.eventCount  = 0;
+        band.pending     = NULL;
+        band.elapsed     = 0.0;
+        band.done        = !EnqueueBand(band, kernelName, filter, type, source, output, width);
+
+        // A device that fails the band, e.g. a CPU driver rejecting the kernel, leaves its rows
+        // to the other devices in turn.
+        size_t failed = band.device;
+        for (size_t d = 0; band.done && (d < _devices.size()); ++d)
+        {
+            clFinish(_devices[band.device].commandQueue);
+            ReleaseBand(band);
+            if (d != failed)
+            {
+                band.device = d;
+                band.done   = !EnqueueBand(band, kernelName, filter, type, source, output, width);
+            }
+        }
+        if (band.done)
+        {
+            clFinish(_devices[band.device].commandQueue);
+            ReleaseBand(band);
+            cout << "Error: " << kernelName << " failed on every OpenCL device for the rows "
+                 << band.first << " to " << band.last << " of " << outName << endl;
+            complete = false;
+        }
+        pending += band.done ? 0 : 1;
+
+        size_t bytes = width * (band.bottom - band.top) * pixel;
+        if (band.imageSrc != NULL)    Memory::Allocate(Memory::Device, inName, bytes);
+        if (band.imageDst != NULL)    Memory::Allocate(Memory::Device, outName, bytes);
+        if (band.imageFilter != NULL) Memory::Allocate(Memory::Device, inName, 9 * sizeof(float));
+    }
+
+    lock.unlock();
+
+    // Wait for the bands without holding the devices, noting when each finishes to rebalance
+    // the next launch.
+    Pending waiting;
+    waiting.count = pending;
+    waiting.start = start;
+    for (size_t i = 0; i < bands.size(); ++i)
+    {
+        Band& band = bands[i];
+        if (band.done)
+        {
+            continue;
+        }
+
+        band.pending = &waiting;
+        cl_event last = band.events[band.eventCount - 1];
+        if (clSetEventCallback(last, CL_COMPLETE, Finished, &band) != CL_SUCCESS)
+        {
+            clWaitForEvents(1, &last);
+            Finished(last, CL_COMPLETE, &band);
+        }
+    }
+
+    {
+        unique_lock<mutex> wait(waiting.lock);
+        waiting.done.wait(wait, [&waiting] { return waiting.count == 0; });
+    }
+
+    if (bands.size() > 1)
+    {
+        lock.lock();
+        for (size_t i = 0; i < bands.size(); ++i)
+        {
+            Band& band = bands[i];
+            if (band.done || (band.elapsed <= 0.0))
+            {
+                continue;
+            }
+
+            ClDevice& device = _devices[band.device];
+            double throughput = width * (band.last - band.first) / band.elapsed;
+            device.throughput = device.measured ? (device.throughput + throughput) / 2 : throughput;
+            device.measured = true;
+        }
+        lock.unlock();
+    }
+
+    // Rows no device computed are garbage in the staging buffer, it isn't unpacked then.
+    double unpack = Now();
+    if ((target == NULL) && complete)
+    {
+        unpackOutput(output);
+    }
+    unpack = Now() - unpack;
+
+    if (_profiling)
+    {
+        lock.lock();
+        Profile(line, kernelName, width * height, pack, unpack, bands);
+        lock.unlock();
+    }
+
+    for (size_t i = 0; i < bands.size(); ++i)
+    {
+        Band& band = bands[i];
+        size_t bytes = width * (band.bottom - band.top) * pixel;
+        if (band.imageFilter != NULL) Memory::Release(Memory::Device, inName, 9 * sizeof(float));
+        if (band.imageDst != NULL)    Memory::Release(Memory::Device, outName, bytes);
+        if (band.imageSrc != NULL)    Memory::Release(Memory::Device, inName, bytes);
+        ReleaseBand(band);
+    }
+
+    if (input != NULL)
+    {
+        delete[] input;
+        Memory::Release(Memory::Staging, inName, staging);
+    }
+    if (target == NULL)
+    {
+        delete[] output;
+        Memory::Release(Memory::Staging, outName, staging);
+    }
+}
+
+// Release the events, kernel and device images of a band, the memory accounting is the caller's.
+void ClProgram::ReleaseBand(Band& band)
+{
+    for (cl_uint e = 0; e < band.eventCount; ++e)
+    {
+        clReleaseEvent(band.events[e]);
+    }
+    if (band.kernel != NULL)      clReleaseKernel(band.kernel);
+    if (band.imageFilter != NULL) clReleaseMemObject(band.imageFilter);
+    if (band.imageDst != NULL)    clReleaseMemObject(band.imageDst);
+    if (band.imageSrc != NULL)    clReleaseMemObject(band.imageSrc);
+
+    band.imageSrc    = NULL;
+    band.imageDst    = NULL;
+    band.imageFilter = NULL;
+    band.kernel      = NULL;
+    band.eventCount  = 0;
+}
+
+// Event callback of the last command of a band, counting the band down in its launch.
+void CL_CALLBACK ClProgram::Finished(cl_event event, cl_int status, void* data)
+{
+    Band& band = *static_cast<Band*>(data);
+
+    lock_guard<mutex> lock(band.pending->lock);
+    band.elapsed = Now() - band.pending->start;
+    band.pending->count--;
+    band.pending->done.notify_all();
+}
+
+// Start to end of a profiled command and the time it waited in the queue, in seconds.
+static void CommandTimes(cl_event event, double& busy, double& wait)
+{
+    cl_ulong queued = 0;
+    cl_ulong start  = 0;
+    cl_ulong end    = 0;
+
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+
+    busy += (end > start) ? (end - start) * 1e-9 : 0.0;
+    wait += (start > queued) ? (start - queued) * 1e-9 : 0.0;
+}
+
+// Add the times of one launch to its statement. Bands are the commands of the upload(s),
+// the kernel and the read back, in that order; bands that failed to enqueue are skipped.
+void ClProgram::Profile(int line, const char* kernelName, size_t pixels, double pack, double unpack,
+                        vector<Band>& bands)
+{
+    char key[32];
+    sprintf(key, "%08d ", line);
+
+    KernelProfile& profile = _profiles[string(key) + kernelName];
+    if (profile.launches == 0)
+    {
+        profile.line = line;
+        profile.kernel = kernelName;
+    }
+
+    profile.launches++;
+    profile.pixels += pixels;
+    profile.pack   += pack;
+    profile.unpack += unpack;
+
+    for (size_t i = 0; i < bands.size(); ++i)
+    {
+        Band& band = bands[i];
+        if (band.eventCount < 3)
+        {
+            continue;
+        }
+
+        for (cl_uint e = 0; e < band.eventCount - 2; ++e)
+        {
+            CommandTimes(band.events[e], profile.write, profile.wait);
+        }
+        CommandTimes(band.events[band.eventCount - 2], profile.run, profile.wait);
+        CommandTimes(band.events[band.eventCount - 1], profile.read, profile.wait);
+    }
+}
+
+// With several devices the transfer and kernel times are summed over the devices.
+void ClProgram::Report()
+{
+    if (_profiles.empty())
+    {
+        return;
+    }
+
+    cerr << endl << "SIP OpenCL profile (ms)" << endl;
+
+    char text[256];
+    sprintf(text, "%6s  %-20s %8s %9s %9s %9s %9s %9s %9s %9s",
+            "line", "kernel", "launches", "pack", "write", "kernel", "read", "unpack", "queued", "MPix/s");
+    cerr << text << endl;
+
+    for (map<string, KernelProfile>::iterator it = _profiles.begin(); it != _profiles.end(); ++it)
+    {
+        KernelProfile& p = it->second;
+        sprintf(text, "%6d  %-20s %8u %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.1f",
+                p.line, p.kernel.c_str(), p.launches, p.pack * 1e3, p.write * 1e3, p.run * 1e3,
+                p.read * 1e3, p.unpack * 1e3, p.wait * 1e3, (p.run > 0.0) ? p.pixels / p.run / 1e6 : 0.0);
+        cerr << text << endl;
+    }
+}
+
+// Images are bucketed by the largest power of two below each side, kernels behave
+// the same within a bucket.
+static size_t SizeClass(size_t size)
+{
+    size_t c = 1;
+    while ((c << 1) <= size)
+    {
+        c <<= 1;
+    }
+    return c;
+}
+
+string ClProgram::TuningKey(ClDevice& device, const char* kernelName, size_t width, size_t height)
+{
+    char size[64];
+    sprintf(size, "%lux%lu", (unsigned long)SizeClass(width), (unsigned long)SizeClass(height));
+
+    string key = device.name + "|" + kernelName + "|" + size;
+    for (size_t i = 0; i < key.size(); ++i)
+    {
+        if ((key[i] == ' ') || (key[i] == '\t'))
+        {
+            key[i] = '_';
+        }
+    }
+    return key;
+}
+
+void ClProgram::LoadTuning()
+{
+    _tuningLoaded = true;
+
+    const char* path = getenv("SIP_TUNING_DB");
+    ifstream db((path != NULL) ? path : TUNING_DB_FILE);
+
+    string key;
+    size_t x = 0;
+    size_t y = 0;
+    while (db >> key >> x >> y)
+    {
+        _localSizes[key] = make_pair(x, y);
+    }
+}
+
+void ClProgram::SaveTuning(const string& key)
+{
+    const char* path = getenv("SIP_TUNING_DB");
+    ofstream db((path != NULL) ? path : TUNING_DB_FILE, ios::app);
+    if (!db)
+    {
+        return;
+    }
+
+    db << key << " " << _localSizes[key].first << " " << _localSizes[key].second << endl;
+}
+
+// Run the kernel once with each candidate local size and keep the fastest one. Every run
+// computes the full output, so the image is correct whichever candidate wins.
+void ClProgram::Tune(ClDevice& device, cl_kernel kernel, const string& key, size_t width, size_t height,
+                     cl_uint waitCount, const cl_event* waitList)
+{
+    static const size_t candidates[][2] = {{0, 0}, {8, 8}, {16, 8}, {16, 16}, {32, 4},
+                                           {32, 8}, {64, 4}, {64, 1}, {128, 1}, {256, 1}};
+    size_t maxSize = 0;
+    clGetKernelWorkGroupInfo(kernel, device.deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxSize), &maxSize, NULL);
+
+    double bestTime = -1.0;
+    pair<size_t, size_t> best(0, 0);
+
+    // Warm up, the first launch of a kernel pays for the driver setup.
+    size_t GWSize[] = {width, height, 1};
+    clEnqueueNDRangeKernel(device.commandQueue, kernel, 2, NULL, GWSize, NULL, waitCount, waitList, NULL);
+    clFinish(device.commandQueue);
+
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+    {
+        size_t x = candidates[i][0];
+        size_t y = candidates[i][1];
+        if ((x * y > maxSize) || (x > width) || (y > height))
+        {
+            continue;
+        }
+
+        size_t LWSize[] = {x, y, 1};
+        if (x != 0)
+        {
+            GWSize[0] = (width + x - 1) / x * x;
+            GWSize[1] = (height + y - 1) / y * y;
+        }
+        else
+        {
+            GWSize[0] = width;
+            GWSize[1] = height;
+        }
+
+        double elapsed = 0.0;
+        for (int run = 0; run < TUNING_RUNS; ++run)
+        {
+            double start = Now();
+            cl_int ret = clEnqueueNDRangeKernel(device.commandQueue, kernel, 2, NULL, GWSize,
+                                                (x != 0) ? LWSize : NULL, 0, NULL, NULL);
+            if (ret != CL_SUCCESS)
+            {
+                elapsed = -1.0;
+                break;
+            }
+            clFinish(device.commandQueue);
+
+            double t = Now() - start;
+            elapsed = ((run == 0) || (t < elapsed)) ? t : elapsed;
+        }
+
+        if ((elapsed >= 0.0) && ((bestTime < 0.0) || (elapsed < bestTime)))
+        {
+            bestTime = elapsed;
+            best = make_pair(x, y);
+        }
+    }
+
+    _localSizes[key] = best;
+    SaveTuning(key);
+}
+
+// Enqueue the kernel over a width x height image with the tuned local size. The global
+// size is padded to a multiple of it, kernels discard the work items outside the image.
+cl_int ClProgram::Launch(ClDevice& device, cl_kernel kernel, const char* kernelName, size_t width, size_t height,
+                         cl_uint waitCount, const cl_event* waitList, cl_event* event)
+{
+    size_t GWSize[] = {width, height, 1};
+    if (!_tuning)
+    {
+        return clEnqueueNDRangeKernel(device.commandQueue, kernel, 2, NULL, GWSize, NULL, waitCount, waitList, event);
+    }
+
+    if (!_tuningLoaded)
+    {
+        LoadTuning();
+    }
+
+    string key = TuningKey(device, kernelName, width, height);
+    if (_localSizes.find(key) == _localSizes.end())
+    {
+        Tune(device, kernel, key, width, height, waitCount, waitList);
+    }
+
+    pair<size_t, size_t> local = _localSizes[key];
+    if (local.first == 0)
+    {
+        return clEnqueueNDRangeKernel(device.commandQueue, kernel, 2, NULL, GWSize, NULL, waitCount, waitList, event);
+    }
+
+    size_t LWSize[] = {local.first, local.second, 1};
+    GWSize[0] = (width + local.first - 1) / local.first * local.first;
+    GWSize[1] = (height + local.second - 1) / local.second * local.second;
+
+    return clEnqueueNDRangeKernel(device.commandQueue, kernel, 2, NULL, GWSize, LWSize, waitCount, waitList, event);
+}
+
+Image::Image() : _name("(unnamed)"),
+                 _bytes(0)
+{
+    Account();
+}
+
+Image::Image(const char* name) : _name(name),
+                                 _bytes(0)
+{
+    Account();
+}
+
+// EasyBMP's copy reads the pixels row by row across the columns, they are copied here a
+// column at a time as they are stored.
+Image::Image(const Image& img) : _name(img._name),
+                                 _bytes(0)
+{
+    BMP& source = const_cast<BMP&>(img._image);
+    int depth = source.TellBitDepth();
+    _image.SetBitDepth(depth);
+    _image.SetSize(source.TellWidth(), source.TellHeight());
+    if ((source.TellHorizontalDPI() != _image.TellHorizontalDPI()) ||
+        (source.TellVerticalDPI() != _image.TellVerticalDPI()))
+    {
+        _image.SetDPI(source.TellHorizontalDPI(), source.TellVerticalDPI());
+    }
+    for (int n = 0; (depth < 16) && (n < (1 << depth)); ++n)
+    {
+        _image.SetColor(n, source.GetColor(n));
+    }
+
+    for (int col = 0; col < source.TellWidth(); ++col)
+    {
+        memcpy(_image(col, 0), source(col, 0), source.TellHeight() * sizeof(RGBApixel));
+    }
+    Account();
+}
+
+Image::~Image()
+{
+    Memory::Release(Memory::Host, _name, _bytes);
+}
+
+// True if the path ends in the extension, whatever its case.
+static bool HasExtension(const char* path, const char* extension)
+{
+    size_t length = strlen(path);
+    size_t suffix = strlen(extension);
+    return (length >= suffix) && (strcasecmp(path + length - suffix, extension) == 0);
+}
+
+// An image being read ahead by Image::prefetch.
+struct Prefetch
+{
+    shared_ptr<Image>   image;
+    shared_future<void> done;
+};
+
+// The reads ahead not taken yet, by path.
+struct Prefetches
+{
+    mutex                 lock;
+    map<string, Prefetch> pending;
+};
+
+static Prefetches& GetPrefetches()
+{
+    static Prefetches prefetches;
+    return prefetches;
+}
+
+// Removes the read ahead of path once it is done, null if there is none.
+static shared_ptr<Image> TakePrefetch(const char* path)
+{
+    Prefetches& prefetches = GetPrefetches();
+    Prefetch taken;
+    {
+        lock_guard<mutex> lock(prefetches.lock);
+        map<string, Prefetch>::iterator found = prefetches.pending.find(path);
+        if (found == prefetches.pending.end())
+        {
+            return shared_ptr<Image>();
+        }
+        taken = found->second;
+        prefetches.pending.erase(found);
+    }
+
+    TraceScope scope("prefetch wait", 0);
+    taken.done.wait();
+    return taken.image;
+}
+
+// True if path is being read ahead and not taken yet.
+static bool IsPrefetched(const char* path)
+{
+    Prefetches& prefetches = GetPrefetches();
+    lock_guard<mutex> lock(prefetches.lock);
+    return prefetches.pending.count(path) != 0;
+}
+
+// The saves not written yet, the last one of each path, and the paths that couldn't be written.
+struct Saves
+{
+    mutex                             lock;
+    map<string, shared_future<void> > pending;
+    vector<string>                    failed;
+};
+
+static Saves& GetSaves()
+{
+    static Saves saves;
+    return saves;
+}
+
+// True on an I/O thread running a save, the write it makes doesn't wait for itself.
+static thread_local bool t_saving = false;
+
+// Waits until the saves of path are written.
+static void WaitSaves(const char* path)
+{
+    if (t_saving)
+    {
+        return;
+    }
+
+    shared_future<void> last;
+    {
+        Saves& saves = GetSaves();
+        lock_guard<mutex> lock(saves.lock);
+        map<string, shared_future<void> >::iterator found = saves.pending.find(path);
+        if (found == saves.pending.end())
+        {
+            return;
+        }
+        last = found->second;
+    }
+
+    TraceScope scope("save wait", 0);
+    last.wait();
+}
+
+// Runs write(path) on the I/O threads once the earlier saves of path are written. Those
+// were queued first and the threads take the tasks in order, so they are running or done.
+static void StartSave(const char* path, const function<bool(const char*)>& write)
+{
+    TakePrefetch(path);
+
+    Saves& saves = GetSaves();
+    string file(path);
+    lock_guard<mutex> lock(saves.lock);
+    shared_future<void> previous = saves.pending[file];
+    shared_ptr<packaged_task<void()> > task = make_shared<packaged_task<void()> >([write, file, previous]()
+    {
+        if (previous.valid())
+        {
+            previous.wait();
+        }
+
+        TraceScope scope("save", 0);
+        t_saving = true;
+        bool written = write(file.c_str());
+        t_saving = false;
+
+        if (!written)
+        {
+            Saves& saves = GetSaves();
+            lock_guard<mutex> lock(saves.lock);
+            saves.failed.push_back(file);
+        }
+    });
+
+    saves.pending[file] = task->get_future().share();
+    ThreadPool::Background([task]() { (*task)(); });
+}
+
+// The image is constructed first, so that the memory counters outlive the reads ahead.
+void Image::prefetch(const char* path)
+{
+    shared_ptr<Image> image = make_shared<Image>("(prefetch)");
+    string file(path);
+    shared_ptr<packaged_task<void()> > task = make_shared<packaged_task<void()> >([image, file]()
+    {
+        TraceScope scope("prefetch", 0);
+        image->Load(file.c_str());
+    });
+
+    Prefetches& prefetches = GetPrefetches();
+    {
+        lock_guard<mutex> lock(prefetches.lock);
+        if (prefetches.pending.count(file) != 0)
+        {
+            return;
+        }
+        Prefetch& started = prefetches.pending[file];
+        started.image = image;
+        started.done  = task->get_future().share();
+    }
+
+    ThreadPool::Background([task]() { (*task)(); });
+}
+
+void Image::read(const char* path)
+{
+    WaitSaves(path);
+
+    shared_ptr<Image> prefetched = TakePrefetch(path);
+    if (prefetched)
+    {
+        Swap(*prefetched);
+        return;
+    }
+
+    Load(path);
+}
+
+void Image::Load(const char* path)
+{
+    if (HasExtension(path, ".raw"))
+    {
+        ReadRaw(path);
+    }
+    else if (HasExtension(path, ".ppm") || HasExtension(path, ".pgm"))
+    {
+        ReadNetpbm(path);
+    }
+    else if (!ReadBmp(path))
+    {
+        _image.ReadFromFile(path);
+    }
+    Account();
+}
+
+// The names stay and the memory counters follow the pixels.
+void Image::Swap(Image& img)
+{
+    _image.Swap(img._image);
+    img.Account();
+    Account();
+}
+
+bool Image::write(const char* path)
+{
+    WaitSaves(path);
+    TakePrefetch(path);
+
+    if (HasExtension(path, ".raw"))
+    {
+        return WriteRaw(path);
+    }
+    else if (HasExtension(path, ".ppm") || HasExtension(path, ".pgm"))
+    {
+        return WriteNetpbm(path, HasExtension(path, ".pgm"));
+    }
+    else
+    {
+        return _image.WriteToFile(path);
+    }
+}
+
+// The copy is taken here, so the image can be changed as soon as this returns.
+void Image::save(const char* path)
+{
+    shared_ptr<Image> copy = make_shared<Image>(*this);
+    StartSave(path, [copy](const char* file) { return copy->write(file); });
+}
+
+int Image::flush()
+{
+    Saves& saves = GetSaves();
+    map<string, shared_future<void> > pending;
+    {
+        lock_guard<mutex> lock(saves.lock);
+        pending.swap(saves.pending);
+    }
+
+    // The last save of a path waits for the earlier ones
+    for (map<string, shared_future<void> >::iterator i = pending.begin(); i != pending.end(); ++i)
+    {
+        i->second.wait();
+    }
+
+    lock_guard<mutex> lock(saves.lock);
+    for (size_t i = 0; i < saves.failed.size(); ++i)
+    {
+        cout << "Couldn't write: " << saves.failed[i] << endl;
+    }
+    int status = saves.failed.empty() ? 0 : 1;
+    saves.failed.clear();
+    return status;
+}
+
+// Next number of a netpbm header, skipping white space and comments.
+static bool NetpbmNumber(FILE* file, unsigned& value)
+{
+    int c = fgetc(file);
+    while ((c == '#') || isspace(c))
+    {
+        if (c == '#')
+        {
+            while ((c != '\n') && (c != EOF))
+            {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+
+    if (!isdigit(c))
+    {
+        return false;
+    }
+
+    value = 0;
+    while (isdigit(c))
+    {
+        value = value * 10 + (c - '0');
+        c = fgetc(file);
+    }
+    return true; // The single white space after the number is consumed
+}
+
+// The samples are read in one block, then blocks of columns are filled on the thread pool,
+// reading consecutive bytes of each row.
+bool Image::ReadNetpbm(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        cout << "Couldn't open: " << path << endl;
+        return false;
+    }
+
+    char magic[2] = { 0, 0 };
+    unsigned w = 0;
+    unsigned h = 0;
+    unsigned maxval = 0;
+    bool valid = (fread(magic, 1, 2, file) == 2) && (magic[0] == 'P') && ((magic[1] == '5') || (magic[1] == '6')) &&
+                 NetpbmNumber(file, w) && NetpbmNumber(file, h) && NetpbmNumber(file, maxval) &&
+                 (w > 0) && (h > 0) && (maxval > 0) && (maxval < 65536);
+
+    int channels = (magic[1] == '6') ? 3 : 1;
+    int bytes = (maxval > 255) ? 2 : 1;
+    size_t row = (size_t)w * channels * bytes;
+    vector<unsigned char> samples;
+    if (valid)
+    {
+        samples.resize(row * h);
+        valid = (fread(&samples[0], 1, samples.size(), file) == samples.size());
+    }
+    fclose(file);
+
+    if (!valid)
+    {
+        cout << "Invalid netpbm image: " << path << endl;
+        return false;
+    }
+
+    _image.SetSize(w, h);
+    _image.SetBitDepth(24);
+    vector<RGBApixel*> columns(w);
+    for (unsigned col = 0; col < w; ++col)
+    {
+        columns[col] = _image(col, 0);
+    }
+
+    const size_t columnsPerTask = 64;
+    ThreadPool::ParallelFor((w + columnsPerTask - 1) / columnsPerTask, [&](size_t task)
+    {
+        unsigned first = (unsigned)(task * columnsPerTask);
+        unsigned last = std::min(first + (unsigned)columnsPerTask, w);
+        for (unsigned r = 0; r < h; ++r)
+        {
+            const unsigned char* line = &samples[r * row];
+            for (unsigned col = first; col < last; ++col)
+            {
+                unsigned value[3] = { 0, 0, 0 };
+                for (int c = 0; c < channels; ++c)
+                {
+                    const unsigned char* sample = line + (col * channels + c) * bytes;
+                    unsigned v = (bytes == 2) ? ((sample[0] << 8) | sample[1]) : sample[0];
+                    value[c] = (maxval == 255) ? v : (v * 255 + maxval / 2) / maxval;
+                }
+
+                RGBApixel* pixel = &columns[col][r];
+                pixel->Red   = value[0];
+                pixel->Green = value[channels == 3 ? 1 : 0];
+                pixel->Blue  = value[channels == 3 ? 2 : 0];
+                pixel->Alpha = 0;
+            }
+        }
+    });
+
+    return true;
+}
+
+// The rows are built on the thread pool and written in one block.
+bool Image::WriteNetpbm(const char* path, bool gray)
+{
+    int w = width();
+    int h = height();
+    int channels = gray ? 1 : 3;
+    size_t row = (size_t)w * channels;
+    vector<unsigned char> samples(row * h);
+    vector<const RGBApixel*> columns(w);
+    for (int col = 0; col < w; ++col)
+    {
+        columns[col] = _image(col, 0);
+    }
+
+    const int rowsPerTask = 64;
+    ThreadPool::ParallelFor((h + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        int first = (int)task * rowsPerTask;
+        int last = std::min(first + rowsPerTask, h);
+        for (int r = first; r < last; ++r)
+        {
+            unsigned char* line = &samples[r * row];
+            for (int col = 0; col < w; ++col)
+            {
+                const RGBApixel* pixel = &columns[col][r];
+                if (gray)
+                {
+                    line[col] = Luma(pixel->Red, pixel->Green, pixel->Blue);
+                }
+                else
+                {
+                    line[3 * col]     = pixel->Red;
+                    line[3 * col + 1] = pixel->Green;
+                    line[3 * col + 2] = pixel->Blue;
+                }
+            }
+        }
+    });
+
+    FILE* file = fopen(path, "wb");
+    bool written = (file != NULL) &&
+                   (fprintf(file, "P%c\n%d %d\n255\n", gray ? '5' : '6', w, h) > 0) &&
+                   (samples.empty() || (fwrite(&samples[0], 1, samples.size(), file) == samples.size()));
+    if (file != NULL)
+    {
+        written = (fclose(file) == 0) && written;
+    }
+    if (!written)
+    {
+        cout << "Couldn't write: " << path << endl;
+    }
+    return written;
+}
+
+// Decodes the rows [first, last) of a bottom up BMP into the columns of the image.
+template <int Depth>
+static void DecodeBmpRows(const unsigned char* pixels, size_t stride, int h, int first, int last,
+                          const vector<RGBApixel*>& columns, const vector<RGBApixel>& palette)
+{
+    for (int r = first; r < last; ++r)
+    {
+        const unsigned char* line = pixels + (size_t)(h - 1 - r) * stride;
+        for (size_t col = 0; col < columns.size(); ++col)
+        {
+            RGBApixel& pixel = columns[col][r];
+            if (Depth == 32)
+            {
+                memcpy(&pixel, line + 4 * col, 4);
+            }
+            else if (Depth == 24)
+            {
+                memcpy(&pixel, line + 3 * col, 3);
+            }
+            else if (Depth == 8)
+            {
+                pixel = palette[line[col]];
+            }
+            else if (Depth == 4)
+            {
+                pixel = palette[(line[col >> 1] >> (4 - 4 * (col & 1))) & 15];
+            }
+            else
+            {
+                pixel = palette[(line[col >> 3] >> (7 - (col & 7))) & 1];
+            }
+        }
+    }
+}
+
+// Every row of a BMP has the same padded size, so the rows of a block are found without
+// reading the ones before, and blocks of rows are decoded in parallel from the mapping. The
+// palette and the start of the pixels follow EasyBMP's reading of the headers. Returns false,
+// leaving the image untouched, for the files EasyBMP should read: compressed, 16 bit,
+// top-down or truncated ones.
+bool Image::ReadBmp(const char* path)
+{
+    int file = open(path, O_RDONLY);
+    struct stat info;
+    if ((file < 0) || (fstat(file, &info) != 0) || (info.st_size < 54))
+    {
+        if (file >= 0)
+        {
+            ::close(file);
+        }
+        return false;
+    }
+
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)mapped;
+    auto word = [&](size_t offset) { return (uint32_t)bytes[offset] | ((uint32_t)bytes[offset + 1] << 8); };
+    auto dword = [&](size_t offset) { return word(offset) | (word(offset + 2) << 16); };
+
+    int offBits = (int)dword(10);
+    int w = (int)dword(18);
+    int h = (int)dword(22);
+    int depth = (int)word(28);
+    uint32_t compression = dword(30);
+
+    int colors = (depth < 16) ? (1 << depth) : 0;
+    size_t stride = (((size_t)(w > 0 ? w : 0) * depth + 7) / 8 + 3) & ~(size_t)3;
+    int paletteRead = std::max(std::min((offBits - 54) / 4, colors), 0);
+    int skipped = std::max(offBits - 54 - 4 * colors, 0);
+    size_t start = 54 + 4 * (size_t)paletteRead + skipped;
+    bool supported = (bytes[0] == 'B') && (bytes[1] == 'M') && (compression == 0) &&
+                     ((depth == 1) || (depth == 4) || (depth == 8) || (depth == 24) || (depth == 32)) &&
+                     (w > 0) && (h > 0) && (start + stride * h <= (size_t)info.st_size);
+    if (!supported)
+    {
+        munmap(mapped, info.st_size);
+        return false;
+    }
+    madvise(mapped, info.st_size, MADV_WILLNEED);
+
+    _image.SetBitDepth(depth);
+    _image.SetSize(w, h);
+    int xPels = (int)dword(38);
+    int yPels = (int)dword(42);
+    if ((xPels != DefaultXPelsPerMeter) || (yPels != DefaultYPelsPerMeter))
+    {
+        _image.SetDPI((int)(xPels / 39.37007874015748 + 0.5), (int)(yPels / 39.37007874015748 + 0.5));
+    }
+
+    vector<RGBApixel> palette(colors);
+    for (int n = 0; n < colors; ++n)
+    {
+        RGBApixel white = { 255, 255, 255, 0 };
+        if (n < paletteRead)
+        {
+            memcpy(&palette[n], bytes + 54 + 4 * n, 4);
+        }
+        else
+        {
+            palette[n] = white;
+        }
+        _image.SetColor(n, palette[n]);
+    }
+
+    vector<RGBApixel*> columns(w);
+    for (int col = 0; col < w; ++col)
+    {
+        columns[col] = _image(col, 0);
+    }
+
+    // Rows are stored bottom up.
+    const unsigned char* pixels = bytes + start;
+    const int rowsPerTask = 64;
+    ThreadPool::ParallelFor((h + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        int first = (int)task * rowsPerTask;
+        int last = std::min(first + rowsPerTask, h);
+        switch (depth)
+        {
+            case 32: DecodeBmpRows<32>(pixels, stride, h, first, last, columns, palette); break;
+            case 24: DecodeBmpRows<24>(pixels, stride, h, first, last, columns, palette); break;
+            case 8:  DecodeBmpRows<8>(pixels, stride, h, first, last, columns, palette); break;
+            case 4:  DecodeBmpRows<4>(pixels, stride, h, first, last, columns, palette); break;
+            default: DecodeBmpRows<1>(pixels, stride, h, first, last, columns, palette); break;
+        }
+    });
+
+    munmap(mapped, info.st_size);
+    return true;
+}
+
+// Header of the ".raw" files, RAW_ALIGN bytes long so that the first column is aligned.
+struct RawHeader
+{
+    char     magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t bitDepth;
+    uint32_t stride; // Bytes from one column to the next
+    uint8_t  padding[RAW_ALIGN - 24];
+};
+
+bool Image::ReadRaw(const char* path)
+{
+    int file = open(path, O_RDONLY);
+    struct stat info;
+    if ((file < 0) || (fstat(file, &info) != 0) || ((size_t)info.st_size < sizeof(RawHeader)))
+    {
+        cout << "Couldn't open: " << path << endl;
+        if (file >= 0)
+        {
+            ::close(file);
+        }
+        return false;
+    }
+
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (mapped == MAP_FAILED)
+    {
+        cout << "Couldn't map: " << path << endl;
+        return false;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+
+    const RawHeader* header = (const RawHeader*)mapped;
+    size_t column = (size_t)header->height * sizeof(RGBApixel);
+    bool valid = (memcmp(header->magic, RAW_MAGIC, sizeof(header->magic)) == 0) &&
+                 (header->stride >= column) &&
+                 ((size_t)info.st_size >= sizeof(RawHeader) + (size_t)header->stride * header->width);
+    if (valid)
+    {
+        _image.SetSize(header->width, header->height);
+        _image.SetBitDepth(header->bitDepth);
+        const char* pixels = (const char*)mapped + sizeof(RawHeader);
+        for (uint32_t col = 0; col < header->width; ++col)
+        {
+            memcpy(_image(col, 0), pixels + (size_t)col * header->stride, column);
+        }
+    }
+    else
+    {
+        cout << "Invalid raw image: " << path << endl;
+    }
+
+    munmap(mapped, info.st_size);
+    return valid;
+}
+
+// One gathered write: the header, then each column followed by its alignment padding.
+bool Image::WriteRaw(const char* path)
+{
+    static const char zeros[RAW_ALIGN] = { 0 };
+
+    RawHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAW_MAGIC, sizeof(header.magic));
+    header.width    = width();
+    header.height   = height();
+    header.bitDepth = _image.TellBitDepth();
+    size_t column   = (size_t)header.height * sizeof(RGBApixel);
+    header.stride   = (uint32_t)((column + RAW_ALIGN - 1) / RAW_ALIGN * RAW_ALIGN);
+
+    vector<struct iovec> parts;
+    struct iovec part = { &header, sizeof(header) };
+    parts.push_back(part);
+    for (uint32_t col = 0; col < header.width; ++col)
+    {
+        struct iovec pixels = { _image(col, 0), column };
+        parts.push_back(pixels);
+        if (header.stride > column)
+        {
+            struct iovec padding = { (void*)zeros, header.stride - column };
+            parts.push_back(padding);
+        }
+    }
+
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = (file >= 0);
+    for (size_t first = 0; written && (first < parts.size()); first += IOV_MAX)
+    {
+        int count = (int)std::min(parts.size() - first, (size_t)IOV_MAX);
+        size_t bytes = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            bytes += parts[first + i].iov_len;
+        }
+        written = (writev(file, &parts[first], count) == (ssize_t)bytes);
+    }
+
+    if (file >= 0)
+    {
+        ::close(file);
+    }
+    if (!written)
+    {
+        cout << "Couldn't write: " << path << endl;
+    }
+    return written;
+}
+
+int Image::width()
+{
+    return _image.TellWidth();
+}
+    
+int Image::height()
+{
+    return _image.TellHeight();
+}
+
+const string& Image::name()
+{
+    return _name;
+}
+
+double Image::sum(Channel channel)
+{
+    return (double)Reduce(channel).sum;
+}
+
+double Image::min(Channel channel)
+{
+    return Reduce(channel).min;
+}
+
+double Image::max(Channel channel)
+{
+    return Reduce(channel).max;
+}
+
+double Image::mean(Channel channel)
+{
+    double count = (double)width() * height();
+    return (count > 0) ? Reduce(channel).sum / count : 0.0;
+}
+
+double Image::stddev(Channel channel)
+{
+    double count = (double)width() * height();
+    if (count <= 0)
+    {
+        return 0.0;
+    }
+
+    Moments m = Reduce(channel);
+    double mean = m.sum / count;
+    double variance = m.squares / count - mean * mean;
+    return (variance > 0) ? sqrt(variance) : 0.0;
+}
+
+// BMP pixels are stored column by column, so each task reduces a block of whole columns
+// with a contiguous, vectorizable inner loop, then the blocks are combined in order.
+Image::Moments Image::Reduce(Channel channel)
+{
+    static const size_t offsets[] = { offsetof(RGBApixel, Red),  offsetof(RGBApixel, Green),
+                                      offsetof(RGBApixel, Blue), offsetof(RGBApixel, Alpha) };
+    const size_t columnsPerTask = 64;
+
+    int w = width();
+    int h = height();
+    Moments total = { 0, 0, 255, 0 };
+    if ((w <= 0) || (h <= 0))
+    {
+        total.min = 0;
+        return total;
+    }
+
+    vector<Moments> partials((w + columnsPerTask - 1) / columnsPerTask);
+    ThreadPool::ParallelFor(partials.size(), [&](size_t task)
+    {
+        Moments m = { 0, 0, 255, 0 };
+        int last = std::min((int)((task + 1) * columnsPerTask), w);
+        for (int col = (int)(task * columnsPerTask); col < last; ++col)
+        {
+            const ebmpBYTE* values = (const ebmpBYTE*)_image(col, 0) + offsets[channel];
+            uint64_t sum = 0;
+            uint64_t squares = 0;
+            unsigned lo = 255;
+            unsigned hi = 0;
+            for (int row = 0; row < h; ++row)
+            {
+                unsigned v = values[row * sizeof(RGBApixel)];
+                sum     += v;
+                squares += v * v;
+                lo = (v < lo) ? v : lo;
+                hi = (v > hi) ? v : hi;
+            }
+
+            m.sum     += sum;
+            m.squares += squares;
+            m.min = std::min(m.min, lo);
+            m.max = std::max(m.max, hi);
+        }
+        partials[task] = m;
+    });
+
+    for (size_t i = 0; i < partials.size(); ++i)
+    {
+        total.sum     += partials[i].sum;
+        total.squares += partials[i].squares;
+        total.min = std::min(total.min, partials[i].min);
+        total.max = std::max(total.max, partials[i].max);
+    }
+    return total;
+}
+
+// Report the change of the pixel bytes since the last call to the memory counters.
+void Image::Account()
+{
+    size_t bytes = (size_t)_image.TellWidth() * _image.TellHeight() * sizeof(RGBApixel);
+    if (bytes > _bytes)
+    {
+        Memory::Allocate(Memory::Host, _name, bytes - _bytes);
+    }
+    else if (bytes < _bytes)
+    {
+        Memory::Release(Memory::Host, _name, _bytes - bytes);
+    }
+    _bytes = bytes;
+}
+
+void Image::clone(Image& img)
+{
+	if (this == &img)
+	{
+	    return;
+	}
+
+	_image.SetSize(img._image.TellWidth(), img._image.TellHeight());
+	_image.SetBitDepth(img._image.TellBitDepth());
+	Account();
+}
+
+void Image::copyRangeTo(unsigned int offsetX,
+                        unsigned int offsetY,
+                        unsigned int width,
+                        unsigned int height,
+                        Image& img)
+{
+    if (((offsetX + width) > (unsigned int)_image.TellWidth()) ||
+        ((offsetY + height) > (unsigned int)_image.TellHeight()))
+    {
+        cout << "Invalid image range..." << endl;
+        return;
+    }
+        
+	img._image.SetSize(width, height);
+	img._image.SetBitDepth(_image.TellBitDepth());
+	img.Account();
+    
+    for (size_t row = 0; row < height; ++row)
+    {
+        for (size_t col = 0; col < width; ++col)
+        {
+            img(row, col)->Red   = (*this)(offsetY + row, offsetX + col)->Red;
+            img(row, col)->Green = (*this)(offsetY + row, offsetX + col)->Green;
+            img(row, col)->Blue  = (*this)(offsetY + row, offsetX + col)->Blue;
+            img(row, col)->Alpha = (*this)(offsetY + row, offsetX + col)->Alpha;
+        }
+    }
+}
+
+// Source pixel and weight contributing to a destination row or column of a resize.
+struct ResizeTap
+{
+    int   index;
+    float weight;
+};
+
+// Taps of each destination index along one axis. Pixel centers are aligned, bilinear
+// clamps at the edges and area weights each source pixel by its coverage.
+static vector<vector<ResizeTap> > ResizeTaps(int source, int destination, Image::Sampling mode)
+{
+    vector<vector<ResizeTap> > taps(destination);
+    double scale = (double)source / destination;
+
+    for (int d = 0; d < destination; ++d)
+    {
+        if (mode == Image::Nearest)
+        {
+            ResizeTap tap = { std::min((int)((d + 0.5) * scale), source - 1), 1.0f };
+            taps[d].push_back(tap);
+        }
+        else if (mode == Image::Bilinear)
+        {
+            double x = std::max((d + 0.5) * scale - 0.5, 0.0);
+            int x0 = std::min((int)x, source - 1);
+            int x1 = std::min(x0 + 1, source - 1);
+            float a = (float)(x - x0);
+            ResizeTap first = { x0, 1.0f - a };
+            ResizeTap second = { x1, a };
+            taps[d].push_back(first);
+            if ((x1 != x0) && (a > 0.0f))
+            {
+                taps[d].push_back(second);
+            }
+            else
+            {
+                taps[d][0].weight = 1.0f;
+            }
+        }
+        else
+        {
+            double lo = d * scale;
+            double hi = std::min((d + 1) * scale, (double)source);
+            for (int s = (int)lo; s < hi; ++s)
+            {
+                double cover = std::min(hi, s + 1.0) - std::max(lo, (double)s);
+                if (cover > 0.0)
+                {
+                    ResizeTap tap = { s, (float)(cover / (hi - lo)) };
+                    taps[d].push_back(tap);
+                }
+            }
+        }
+    }
+
+    return taps;
+}
+
+// Separable resize: each task builds a block of destination columns, first blending the
+// source columns into one column of floats, then blending its rows. BMP columns are
+// contiguous, so both inner loops run over consecutive bytes.
+void Image::resizeTo(int width, int height, Sampling mode, Image& img)
+{
+    if (this == &img)
+    {
+        Image copy(_name.c_str());
+        copy = *this;
+        copy.resizeTo(width, height, mode, img);
+        return;
+    }
+
+    int w = this->width();
+    int h = this->height();
+    if ((width <= 0) || (height <= 0) || (w <= 0) || (h <= 0))
+    {
+        cout << "Invalid resize of " << _name << " to " << width << "x" << height << endl;
+        return;
+    }
+
+    img._image.SetSize(width, height);
+    img._image.SetBitDepth(_image.TellBitDepth());
+    img.Account();
+
+    vector<vector<ResizeTap> > columns = ResizeTaps(w, width, mode);
+    vector<vector<ResizeTap> > rows = ResizeTaps(h, height, mode);
+    const int channels = sizeof(RGBApixel);
+    const size_t columnsPerTask = 16;
+
+    ThreadPool::ParallelFor((width + columnsPerTask - 1) / columnsPerTask, [&](size_t task)
+    {
+        vector<float> column(h * channels);
+        int last = std::min((int)((task + 1) * columnsPerTask), width);
+        for (int col = (int)(task * columnsPerTask); col < last; ++col)
+        {
+            fill(column.begin(), column.end(), 0.0f);
+            for (size_t t = 0; t < columns[col].size(); ++t)
+            {
+                const ebmpBYTE* source = (const ebmpBYTE*)_image(columns[col][t].index, 0);
+                float weight = columns[col][t].weight;
+                for (int i = 0; i < h * channels; ++i)
+                {
+                    column[i] += weight * source[i];
+                }
+            }
+
+            ebmpBYTE* target = (ebmpBYTE*)img._image(col, 0);
+            for (int row = 0; row < height; ++row)
+            {
+                float pixel[channels] = { 0.0f };
+                for (size_t t = 0; t < rows[row].size(); ++t)
+                {
+                    const float* source = &column[rows[row][t].index * channels];
+                    for (int c = 0; c < channels; ++c)
+                    {
+                        pixel[c] += rows[row][t].weight * source[c];
+                    }
+                }
+                for (int c = 0; c < channels; ++c)
+                {
+                    target[row * channels + c] = (ebmpBYTE)std::min(std::max(pixel[c] + 0.5f, 0.0f), 255.0f);
+                }
+            }
+        }
+    });
+}
+
+// Histograms of the red, green and blue values, or of the gray values, of one row of the
+// window, fine (256 bins) and coarse (16 bins of 16 values) as in Perreault and Hebert's
+// constant time median.
+template <int Channels>
+struct MedianRow
+{
+    uint16_t fine[Channels][256];
+    uint16_t coarse[Channels][16];
+};
+
+static inline void MedianCount(MedianRow<3>& row, const RGBApixel& pixel, int delta)
+{
+    row.fine[0][pixel.Red]   += delta;
+    row.fine[1][pixel.Green] += delta;
+    row.fine[2][pixel.Blue]  += delta;
+    row.coarse[0][pixel.Red >> 4]   += delta;
+    row.coarse[1][pixel.Green >> 4] += delta;
+    row.coarse[2][pixel.Blue >> 4]  += delta;
+}
+
+static inline void MedianCount(MedianRow<1>& row, const GrayPixel& pixel, int delta)
+{
+    row.fine[0][pixel.Luma] += delta;
+    row.coarse[0][pixel.Luma >> 4] += delta;
+}
+
+// Value of the given rank in the window, found in the coarse bins and then in the fine bins
+// of the one coarse bin that holds it.
+static inline ebmpBYTE MedianOf(const uint32_t* fine, const uint32_t* coarse, uint32_t rank)
+{
+    int bin = 0;
+    uint32_t seen = 0;
+    while (seen + coarse[bin] <= rank)
+    {
+        seen += coarse[bin++];
+    }
+
+    int value = bin << 4;
+    while (seen + fine[value] <= rank)
+    {
+        seen += fine[value++];
+    }
+    return (ebmpBYTE)value;
+}
+
+static inline void MedianStore(RGBApixel& target, const RGBApixel& source, uint32_t fine[3][256],
+                               uint32_t coarse[3][16], uint32_t rank)
+{
+    target.Red   = MedianOf(fine[0], coarse[0], rank);
+    target.Green = MedianOf(fine[1], coarse[1], rank);
+    target.Blue  = MedianOf(fine[2], coarse[2], rank);
+    target.Alpha = source.Alpha;
+}
+
+static inline void MedianStore(GrayPixel& target, const GrayPixel&, uint32_t fine[1][256],
+                               uint32_t coarse[1][16], uint32_t rank)
+{
+    target.Luma = MedianOf(fine[0], coarse[0], rank);
+}
+
+// Strips of rows run on the thread pool. Each strip keeps the histogram of every row of its
+// windows over the current column's window, moving to the next column adds one pixel to and
+// removes one from each. The window's histogram then slides down the strip, adding and
+// removing one row histogram per pixel, so the cost doesn't depend on the radius. Edges are
+// replicated.
+template <class Picture, class Pixel, int Channels>
+static void ApplyMedian(Picture& src, int radius, Picture& img)
+{
+    if (radius < 0)
+    {
+        cout << "Invalid median radius " << radius << " on " << src.name() << endl;
+        return;
+    }
+
+    if (&src == &img)
+    {
+        Picture copy(src.name().c_str());
+        copy = src;
+        ApplyMedian<Picture, Pixel, Channels>(copy, radius, img);
+        return;
+    }
+
+    int w = src.width();
+    int h = src.height();
+    int window = 2 * radius + 1;
+    uint32_t rank = (uint32_t)(window * window) / 2;
+    int strip = std::max(64, 4 * radius); // Keeps the window's setup per column and strip cheap
+    img.clone(src);
+
+    ThreadPool::ParallelFor((h + strip - 1) / strip, [&](size_t task)
+    {
+        int first = (int)task * strip;
+        int last = std::min(first + strip, h);
+        int top = first - radius;
+        int lines = last - first + 2 * radius;
+        vector<MedianRow<Channels> > rows(lines);
+        memset(&rows[0], 0, lines * sizeof(MedianRow<Channels>));
+
+        for (int k = -radius; k <= radius; ++k)
+        {
+            const Pixel* column = src(0, std::min(std::max(k, 0), w - 1));
+            for (int l = 0; l < lines; ++l)
+            {
+                MedianCount(rows[l], column[std::min(std::max(top + l, 0), h - 1)], 1);
+            }
+        }
+
+        uint32_t fine[Channels][256];
+        uint32_t coarse[Channels][16];
+        for (int col = 0; col < w; ++col)
+        {
+            if (col > 0)
+            {
+                const Pixel* entering = src(0, std::min(col + radius, w - 1));
+                const Pixel* leaving = src(0, std::max(col - radius - 1, 0));
+                for (int l = 0; l < lines; ++l)
+                {
+                    int row = std::min(std::max(top + l, 0), h - 1);
+                    MedianCount(rows[l], entering[row], 1);
+                    MedianCount(rows[l], leaving[row], -1);
+                }
+            }
+
+            memset(fine, 0, sizeof(fine));
+            memset(coarse, 0, sizeof(coarse));
+            for (int l = 0; l < window; ++l)
+            {
+                for (int c = 0; c < Channels; ++c)
+                {
+                    for (int v = 0; v < 256; ++v)
+                    {
+                        fine[c][v] += rows[l].fine[c][v];
+                    }
+                    for (int v = 0; v < 16; ++v)
+                    {
+                        coarse[c][v] += rows[l].coarse[c][v];
+                    }
+                }
+            }
+
+            Pixel* target = img(0, col);
+            const Pixel* source = src(0, col);
+            for (int row = first; row < last; ++row)
+            {
+                if (row > first)
+                {
+                    const MedianRow<Channels>& entering = rows[row - first + 2 * radius];
+                    const MedianRow<Channels>& leaving = rows[row - first - 1];
+                    for (int c = 0; c < Channels; ++c)
+                    {
+                        for (int v = 0; v < 256; ++v)
+                        {
+                            fine[c][v] += entering.fine[c][v] - leaving.fine[c][v];
+                        }
+                        for (int v = 0; v < 16; ++v)
+                        {
+                            coarse[c][v] += entering.coarse[c][v] - leaving.coarse[c][v];
+                        }
+                    }
+                }
+
+                MedianStore(target[row], source[row], fine, coarse, rank);
+            }
+        }
+    });
+}
+
+void Image::median(int radius, Image& img)
+{
+    ApplyMedian<Image, RGBApixel, 3>(*this, radius, img);
+}
+
+// Third order recursive Gaussian of Young and van Vliet, run forward then backward over the
+// lines. Each line is "size" contiguous floats filtered independently of the others, and the
+// edges start from the steady state of a constant signal.
+static void RecursiveGaussian(const vector<float*>& lines, size_t size, const float* coefficients,
+                              vector<float>& edge)
+{
+    float b  = coefficients[0];
+    float a1 = coefficients[1];
+    float a2 = coefficients[2];
+    float a3 = coefficients[3];
+    int count = (int)lines.size();
+
+    edge.assign(lines[0], lines[0] + size);
+    const float* p1 = &edge[0];
+    const float* p2 = p1;
+    const float* p3 = p1;
+    for (int i = 0; i < count; ++i)
+    {
+        float* x = lines[i];
+        for (size_t k = 0; k < size; ++k)
+        {
+            x[k] = b * x[k] + a1 * p1[k] + a2 * p2[k] + a3 * p3[k];
+        }
+        p3 = p2;
+        p2 = p1;
+        p1 = x;
+    }
+
+    edge.assign(lines[count - 1], lines[count - 1] + size);
+    p1 = &edge[0];
+    p2 = p1;
+    p3 = p1;
+    for (int i = count - 1; i >= 0; --i)
+    {
+        float* x = lines[i];
+        for (size_t k = 0; k < size; ++k)
+        {
+            x[k] = b * x[k] + a1 * p1[k] + a2 * p2[k] + a3 * p3[k];
+        }
+        p3 = p2;
+        p2 = p1;
+        p1 = x;
+    }
+}
+
+// The recursion costs the same for any sigma. The horizontal pass filters strips of rows
+// of whole columns at once, so its inner loop runs across rows; the vertical pass filters
+// each column, four channels at a time.
+template <class Picture, class Pixel>
+static void ApplyGaussian(Picture& src, float sigma, Picture& img)
+{
+    if (sigma < 0.5f)
+    {
+        img = src;
+        return;
+    }
+
+    float q = (sigma >= 2.5f) ? 0.98711f * sigma - 0.96330f
+                              : 3.97156f - 4.14554f * sqrtf(1.0f - 0.26891f * sigma);
+    float b0 = 1.57825f + 2.44413f * q + 1.4281f * q * q + 0.422205f * q * q * q;
+    float b1 = 2.44413f * q + 2.85619f * q * q + 1.26661f * q * q * q;
+    float b2 = -(1.4281f * q * q + 1.26661f * q * q * q);
+    float b3 = 0.422205f * q * q * q;
+    float coefficients[] = { 1.0f - (b1 + b2 + b3) / b0, b1 / b0, b2 / b0, b3 / b0 };
+
+    const int strip = 256;
+    const size_t channels = sizeof(Pixel);
+    int w = src.width();
+    int h = src.height();
+    vector<float> data((size_t)w * h * channels);
+
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        const ebmpBYTE* source = (const ebmpBYTE*)src(0, (int)col);
+        float* column = &data[col * h * channels];
+        for (size_t k = 0; k < h * channels; ++k)
+        {
+            column[k] = source[k];
+        }
+    });
+
+    ThreadPool::ParallelFor((h + strip - 1) / strip, [&](size_t task)
+    {
+        int first = (int)task * strip;
+        int rows = std::min(strip, h - first);
+        vector<float*> lines(w);
+        for (int col = 0; col < w; ++col)
+        {
+            lines[col] = &data[((size_t)col * h + first) * channels];
+        }
+
+        vector<float> edge;
+        RecursiveGaussian(lines, rows * channels, coefficients, edge);
+    });
+
+    img.clone(src);
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        float* column = &data[col * h * channels];
+        vector<float*> lines(h);
+        for (int row = 0; row < h; ++row)
+        {
+            lines[row] = column + row * channels;
+        }
+
+        vector<float> edge;
+        RecursiveGaussian(lines, channels, coefficients, edge);
+
+        ebmpBYTE* target = (ebmpBYTE*)img(0, (int)col);
+        for (size_t k = 0; k < h * channels; ++k)
+        {
+            target[k] = (ebmpBYTE)std::min(std::max(column[k] + 0.5f, 0.0f), 255.0f);
+        }
+    });
+}
+
+void Image::gaussian(float sigma, Image& img)
+{
+    ApplyGaussian<Image, RGBApixel>(*this, sigma, img);
+}
+
+struct MinOp
+{
+    static ebmpBYTE Apply(ebmpBYTE a, ebmpBYTE b) { return (a < b) ? a : b; }
+    static const ebmpBYTE identity = 255;
+};
+
+struct MaxOp
+{
+    static ebmpBYTE Apply(ebmpBYTE a, ebmpBYTE b) { return (a > b) ? a : b; }
+    static const ebmpBYTE identity = 0;
+};
+
+// van Herk/Gil-Werman running extremum over windows of "window" lines. The lines are padded
+// with the identity so that windows are centered, cut in blocks of "window" lines, and each
+// block gets its prefix and suffix extrema; a window then spans one suffix and one prefix.
+// A line is "size" contiguous bytes, and every step runs over whole lines.
+template <class Op>
+static void RunningExtremum(const vector<const ebmpBYTE*>& lines, size_t size, int window,
+                            vector<ebmpBYTE>& prefix, vector<ebmpBYTE>& suffix,
+                            const vector<ebmpBYTE*>& out)
+{
+    int count = (int)lines.size();
+    int before = (window - 1) / 2;
+    int padded = count + window - 1;
+    prefix.resize(padded * size);
+    suffix.resize(padded * size);
+
+    for (int p = 0; p < padded; ++p)
+    {
+        int i = p - before;
+        const ebmpBYTE* line = ((i >= 0) && (i < count)) ? lines[i] : NULL;
+        ebmpBYTE* g = &prefix[p * size];
+        if (line == NULL)
+        {
+            memset(g, Op::identity, size);
+        }
+        else
+        {
+            memcpy(g, line, size);
+        }
+        if (p % window != 0)
+        {
+            const ebmpBYTE* previous = g - size;
+            for (size_t k = 0; k < size; ++k)
+            {
+                g[k] = Op::Apply(previous[k], g[k]);
+            }
+        }
+    }
+
+    for (int p = padded - 1; p >= 0; --p)
+    {
+        int i = p - before;
+        const ebmpBYTE* line = ((i >= 0) && (i < count)) ? lines[i] : NULL;
+        ebmpBYTE* h = &suffix[p * size];
+        bool last = (p == padded - 1) || ((p + 1) % window == 0);
+        if (line == NULL)
+        {
+            memset(h, Op::identity, size);
+        }
+        else
+        {
+            memcpy(h, line, size);
+        }
+        if (!last)
+        {
+            const ebmpBYTE* next = h + size;
+            for (size_t k = 0; k < size; ++k)
+            {
+                h[k] = Op::Apply(next[k], h[k]);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const ebmpBYTE* h = &suffix[i * size];
+        const ebmpBYTE* g = &prefix[(i + window - 1) * size];
+        ebmpBYTE* o = out[i];
+        for (size_t k = 0; k < size; ++k)
+        {
+            o[k] = Op::Apply(h[k], g[k]);
+        }
+    }
+}
+
+// Erosion (minimum) or dilation (maximum) over a rectangle, three comparisons per byte
+// whatever its size. The horizontal pass treats strips of rows of whole BMP columns as the
+// lines, the vertical pass each column's pixels, so both run over contiguous bytes.
+template <class Op, class Picture, class Pixel>
+static void Extrema(Picture& src, int width, int height, Picture& img)
+{
+    const int strip = 256;
+    const size_t pixel = sizeof(Pixel);
+    int w = src.width();
+    int h = src.height();
+    vector<ebmpBYTE> horizontal((size_t)w * h * pixel);
+
+    ThreadPool::ParallelFor((h + strip - 1) / strip, [&](size_t task)
+    {
+        int first = (int)task * strip;
+        int rows = std::min(strip, h - first);
+        vector<const ebmpBYTE*> lines(w);
+        vector<ebmpBYTE*> out(w);
+        for (int col = 0; col < w; ++col)
+        {
+            lines[col] = (const ebmpBYTE*)src(first, col);
+            out[col] = &horizontal[((size_t)col * h + first) * pixel];
+        }
+
+        vector<ebmpBYTE> prefix;
+        vector<ebmpBYTE> suffix;
+        RunningExtremum<Op>(lines, rows * pixel, width, prefix, suffix, out);
+    });
+
+    img.clone(src);
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        vector<const ebmpBYTE*> lines(h);
+        vector<ebmpBYTE*> out(h);
+        ebmpBYTE* target = (ebmpBYTE*)img(0, (int)col);
+        for (int row = 0; row < h; ++row)
+        {
+            lines[row] = &horizontal[((size_t)col * h + row) * pixel];
+            out[row] = target + row * pixel;
+        }
+
+        vector<ebmpBYTE> prefix;
+        vector<ebmpBYTE> suffix;
+        RunningExtremum<Op>(lines, pixel, height, prefix, suffix, out);
+    });
+}
+
+template <class Picture, class Pixel>
+static void Extremum(Picture& src, bool maximum, int width, int height, Picture& img)
+{
+    if (maximum)
+    {
+        Extrema<MaxOp, Picture, Pixel>(src, width, height, img);
+    }
+    else
+    {
+        Extrema<MinOp, Picture, Pixel>(src, width, height, img);
+    }
+}
+
+// Opening and closing run one pass into a temporary of the same type.
+template <class Picture, class Pixel>
+static void ApplyMorphology(Picture& src, Image::Morphology op, int width, int height, Picture& img)
+{
+    if ((width <= 0) || (height <= 0))
+    {
+        cout << "Invalid morphology window " << width << "x" << height << " on " << src.name() << endl;
+        return;
+    }
+
+    if ((op == Image::Erode) || (op == Image::Dilate))
+    {
+        Extremum<Picture, Pixel>(src, op == Image::Dilate, width, height, img);
+        return;
+    }
+
+    Picture first(src.name().c_str());
+    Extremum<Picture, Pixel>(src, op == Image::Close, width, height, first);
+    Extremum<Picture, Pixel>(first, op == Image::Open, width, height, img);
+}
+
+void Image::morphology(Morphology op, int width, int height, Image& img)
+{
+    ApplyMorphology<Image, RGBApixel>(*this, op, width, height, img);
+}
+
+// BMP pixels are addressed as (x, y), that is (col, row).
+RGBApixel* Image::operator()(int row, int col)
+{
+    return _image(col, row);
+}
+
+Image& Image::operator=(Image &rhs)
+{
+	if (this == &rhs)
+	{
+	    return *this;
+	}
+
+	clone(rhs);
+
+    for (int row = 0; row < height(); ++row)
+    {
+        for (int col = 0; col < width(); ++col)
+        {
+            (*this)(row, col)->Red   = rhs(row, col)->Red;
+            (*this)(row, col)->Green = rhs(row, col)->Green;
+            (*this)(row, col)->Blue  = rhs(row, col)->Blue;
+            (*this)(row, col)->Alpha = rhs(row, col)->Alpha;
+        }
+    }
+
+    return *this;
+}
+
+Image& Image::operator=(Gray &rhs)
+{
+    int w = rhs.width();
+    int h = rhs.height();
+    _image.SetSize(w, h);
+    _image.SetBitDepth(24);
+    Account();
+
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        const GrayPixel* source = rhs(0, (int)col);
+        RGBApixel* target = (*this)(0, (int)col);
+        for (int row = 0; row < h; ++row)
+        {
+            target[row].Red   = source[row].Luma;
+            target[row].Green = source[row].Luma;
+            target[row].Blue  = source[row].Luma;
+            target[row].Alpha = 0;
+        }
+    });
+
+    return *this;
+}
+
+Gray::Gray() : _name("(unnamed)"),
+               _width(0),
+               _height(0)
+{
+}
+
+Gray::Gray(const char* name) : _name(name),
+                               _width(0),
+                               _height(0)
+{
+}
+
+Gray::Gray(const Gray& img) : _name(img._name),
+                              _width(0),
+                              _height(0)
+{
+    SetSize(img._width, img._height);
+    _pixels = img._pixels;
+}
+
+Gray::~Gray()
+{
+    Memory::Release(Memory::Host, _name, _pixels.size());
+}
+
+int Gray::width()
+{
+    return _width;
+}
+
+int Gray::height()
+{
+    return _height;
+}
+
+const string& Gray::name()
+{
+    return _name;
+}
+
+// Resize the pixels and report the change to the memory counters.
+void Gray::SetSize(int width, int height)
+{
+    size_t bytes = (size_t)width * height;
+    if (bytes > _pixels.size())
+    {
+        Memory::Allocate(Memory::Host, _name, bytes - _pixels.size());
+    }
+    else if (bytes < _pixels.size())
+    {
+        Memory::Release(Memory::Host, _name, _pixels.size() - bytes);
+    }
+    _pixels.resize(bytes);
+    _width = width;
+    _height = height;
+}
+
+void Gray::clone(Gray& img)
+{
+    if (this == &img)
+    {
+        return;
+    }
+
+    SetSize(img._width, img._height);
+}
+
+GrayPixel* Gray::operator()(int row, int col)
+{
+    return (GrayPixel*)(_pixels.data() + (size_t)col * _height + row);
+}
+
+Gray& Gray::operator=(Gray &rhs)
+{
+    if (this == &rhs)
+    {
+        return *this;
+    }
+
+    SetSize(rhs._width, rhs._height);
+    _pixels = rhs._pixels;
+    return *this;
+}
+
+Gray& Gray::operator=(Image &rhs)
+{
+    int w = rhs.width();
+    int h = rhs.height();
+    SetSize(w, h);
+
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        const RGBApixel* source = rhs(0, (int)col);
+        ebmpBYTE* target = &_pixels[col * h];
+        for (int row = 0; row < h; ++row)
+        {
+            target[row] = Luma(source[row].Red, source[row].Green, source[row].Blue);
+        }
+    });
+
+    return *this;
+}
+
+void Gray::morphology(Image::Morphology op, int width, int height, Gray& img)
+{
+    ApplyMorphology<Gray, GrayPixel>(*this, op, width, height, img);
+}
+
+void Gray::median(int radius, Gray& img)
+{
+    ApplyMedian<Gray, GrayPixel, 1>(*this, radius, img);
+}
+
+void Gray::gaussian(float sigma, Gray& img)
+{
+    ApplyGaussian<Gray, GrayPixel>(*this, sigma, img);
+}
+
+// ".pgm" files are read and written directly, other formats and prefetched files go through
+// an Image.
+void Gray::read(const char* path)
+{
+    WaitSaves(path);
+
+    if (HasExtension(path, ".pgm") && !IsPrefetched(path))
+    {
+        ReadPgm(path);
+        return;
+    }
+
+    Image img(_name.c_str());
+    img.read(path);
+    *this = img;
+}
+
+bool Gray::write(const char* path)
+{
+    WaitSaves(path);
+    TakePrefetch(path);
+
+    if (HasExtension(path, ".pgm"))
+    {
+        return WritePgm(path);
+    }
+    else if (HasExtension(path, ".raw") || HasExtension(path, ".ppm"))
+    {
+        Image img(_name.c_str());
+        img = *this;
+        return img.write(path);
+    }
+    else
+    {
+        return WriteBmp(path);
+    }
+}
+
+void Gray::save(const char* path)
+{
+    shared_ptr<Gray> copy = make_shared<Gray>(*this);
+    StartSave(path, [copy](const char* file) { return copy->write(file); });
+}
+
+// A P5 file is read in one block and its rows are spread over the columns on the thread pool.
+bool Gray::ReadPgm(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        cout << "Couldn't open: " << path << endl;
+        return false;
+    }
+
+    char magic[2] = { 0, 0 };
+    unsigned w = 0;
+    unsigned h = 0;
+    unsigned maxval = 0;
+    bool valid = (fread(magic, 1, 2, file) == 2) && (magic[0] == 'P') && (magic[1] == '5') &&
+                 NetpbmNumber(file, w) && NetpbmNumber(file, h) && NetpbmNumber(file, maxval) &&
+                 (w > 0) && (h > 0) && (maxval > 0) && (maxval < 65536);
+
+    int bytes = (maxval > 255) ? 2 : 1;
+    vector<unsigned char> samples;
+    if (valid)
+    {
+        samples.resize((size_t)w * h * bytes);
+        valid = (fread(&samples[0], 1, samples.size(), file) == samples.size());
+    }
+    fclose(file);
+
+    if (!valid)
+    {
+        cout << "Invalid pgm image: " << path << endl;
+        return false;
+    }
+
+    SetSize(w, h);
+    const unsigned columnsPerTask = 64;
+    ThreadPool::ParallelFor((w + columnsPerTask - 1) / columnsPerTask, [&](size_t task)
+    {
+        unsigned first = (unsigned)task * columnsPerTask;
+        unsigned last = std::min(first + columnsPerTask, w);
+        for (unsigned r = 0; r < h; ++r)
+        {
+            const unsigned char* line = &samples[(size_t)r * w * bytes];
+            for (unsigned col = first; col < last; ++col)
+            {
+                const unsigned char* sample = line + col * bytes;
+                unsigned v = (bytes == 2) ? ((sample[0] << 8) | sample[1]) : sample[0];
+                _pixels[(size_t)col * h + r] = (maxval == 255) ? v : (v * 255 + maxval / 2) / maxval;
+            }
+        }
+    });
+
+    return true;
+}
+
+// The rows are built on the thread pool and written in one block, for ".pgm" and ".bmp" alike.
+static bool WriteBlock(const char* path, const char* header, size_t headerSize, const vector<unsigned char>& data)
+{
+    FILE* file = fopen(path, "wb");
+    bool written = (file != NULL) &&
+                   (fwrite(header, 1, headerSize, file) == headerSize) &&
+                   (data.empty() || (fwrite(&data[0], 1, data.size(), file) == data.size()));
+    if (file != NULL)
+    {
+        written = (fclose(file) == 0) && written;
+    }
+    if (!written)
+    {
+        cout << "Couldn't write: " << path << endl;
+    }
+    return written;
+}
+
+bool Gray::WritePgm(const char* path)
+{
+    int w = _width;
+    int h = _height;
+    vector<unsigned char> samples((size_t)w * h);
+
+    const int rowsPerTask = 64;
+    ThreadPool::ParallelFor((h + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        int first = (int)task * rowsPerTask;
+        int last = std::min(first + rowsPerTask, h);
+        for (int r = first; r < last; ++r)
+        {
+            unsigned char* line = &samples[(size_t)r * w];
+            for (int col = 0; col < w; ++col)
+            {
+                line[col] = _pixels[(size_t)col * h + r];
+            }
+        }
+    });
+
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", w, h);
+    return WriteBlock(path, header, length, samples);
+}
+
+// An 8 bit BMP with a palette of the 256 gray levels, the rows bottom up and padded to four
+// bytes. EasyBMP would search its palette for every pixel, so the file is built here.
+bool Gray::WriteBmp(const char* path)
+{
+    int w = _width;
+    int h = _height;
+    size_t stride = ((size_t)w + 3) & ~(size_t)3;
+    const uint32_t paletteOffset = 14 + 40;
+    const uint32_t pixelOffset = paletteOffset + 256 * 4;
+    vector<unsigned char> rows(stride * h, 0);
+
+    char header[pixelOffset];
+    memset(header, 0, sizeof(header));
+    auto put = [&](size_t offset, uint32_t value, int size)
+    {
+        for (int k = 0; k < size; ++k)
+        {
+            header[offset + k] = (char)((value >> (8 * k)) & 0xff);
+        }
+    };
+    header[0] = 'B';
+    header[1] = 'M';
+    put(2, (uint32_t)(pixelOffset + rows.size()), 4);
+    put(10, pixelOffset, 4);
+    put(14, 40, 4);                  // Size of the info header
+    put(18, (uint32_t)w, 4);
+    put(22, (uint32_t)h, 4);
+    put(26, 1, 2);                   // Planes
+    put(28, 8, 2);                   // Bits per pixel
+    put(34, (uint32_t)rows.size(), 4);
+    put(38, DefaultXPelsPerMeter, 4);
+    put(42, DefaultYPelsPerMeter, 4);
+    put(46, 256, 4);                 // Colors in the palette
+    for (uint32_t v = 0; v < 256; ++v)
+    {
+        put(paletteOffset + 4 * v, v | (v << 8) | (v << 16), 4);
+    }
+
+    const int rowsPerTask = 64;
+    ThreadPool::ParallelFor((h + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        int first = (int)task * rowsPerTask;
+        int last = std::min(first + rowsPerTask, h);
+        for (int r = first; r < last; ++r)
+        {
+            unsigned char* line = &rows[(size_t)(h - 1 - r) * stride];
+            for (int col = 0; col < w; ++col)
+            {
+                line[col] = _pixels[(size_t)col * h + r];
+            }
+        }
+    });
+
+    return WriteBlock(path, header, sizeof(header), rows);
+}
+
+Image& Image::operator=(FloatImage &rhs)
+{
+    int w = rhs.width();
+    int h = rhs.height();
+    _image.SetSize(w, h);
+    _image.SetBitDepth(24);
+    Account();
+
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        RGBApixel* target = (*this)(0, (int)col);
+        for (int row = 0; row < h; ++row)
+        {
+            const FloatPixel* pixel = rhs(row, (int)col);
+            target[row].Red   = Quantize(pixel->Red);
+            target[row].Green = Quantize(pixel->Green);
+            target[row].Blue  = Quantize(pixel->Blue);
+            target[row].Alpha = Quantize(pixel->Alpha);
+        }
+    });
+
+    return *this;
+}
+
+FloatImage::FloatImage() : _name("(unnamed)"),
+                           _width(0),
+                           _height(0)
+{
+}
+
+FloatImage::FloatImage(const char* name) : _name(name),
+                                           _width(0),
+                                           _height(0)
+{
+}
+
+FloatImage::FloatImage(const FloatImage& img) : _name(img._name),
+                                                _width(0),
+                                                _height(0)
+{
+    SetSize(img._width, img._height);
+    _pixels = img._pixels;
+}
+
+FloatImage::~FloatImage()
+{
+    Memory::Release(Memory::Host, _name, _pixels.size() * sizeof(FloatPixel));
+}
+
+int FloatImage::width()
+{
+    return _width;
+}
+
+int FloatImage::height()
+{
+    return _height;
+}
+
+const string& FloatImage::name()
+{
+    return _name;
+}
+
+// Resize the pixels and report the change to the memory counters.
+void FloatImage::SetSize(int width, int height)
+{
+    size_t bytes = (size_t)width * height * sizeof(FloatPixel);
+    size_t current = _pixels.size() * sizeof(FloatPixel);
+    if (bytes > current)
+    {
+        Memory::Allocate(Memory::Host, _name, bytes - current);
+    }
+    else if (bytes < current)
+    {
+        Memory::Release(Memory::Host, _name, current - bytes);
+    }
+    _pixels.resize((size_t)width * height);
+    _width = width;
+    _height = height;
+}
+
+void FloatImage::clone(FloatImage& img)
+{
+    if (this == &img)
+    {
+        return;
+    }
+
+    SetSize(img._width, img._height);
+}
+
+FloatPixel* FloatImage::operator()(int row, int col)
+{
+    return _pixels.data() + (size_t)row * _width + col;
+}
+
+FloatImage& FloatImage::operator=(FloatImage &rhs)
+{
+    if (this == &rhs)
+    {
+        return *this;
+    }
+
+    SetSize(rhs._width, rhs._height);
+    _pixels = rhs._pixels;
+    return *this;
+}
+
+FloatImage& FloatImage::operator=(Image &rhs)
+{
+    int w = rhs.width();
+    int h = rhs.height();
+    SetSize(w, h);
+
+    const float scale = 1.0f / 255.0f;
+    ThreadPool::ParallelFor(w, [&](size_t col)
+    {
+        const RGBApixel* source = rhs(0, (int)col);
+        for (int row = 0; row < h; ++row)
+        {
+            FloatPixel* pixel = &_pixels[(size_t)row * w + col];
+            pixel->Red   = source[row].Red * scale;
+            pixel->Green = source[row].Green * scale;
+            pixel->Blue  = source[row].Blue * scale;
+            pixel->Alpha = source[row].Alpha * scale;
+        }
+    });
+
+    return *this;
+}
+
+// Files hold 8 bit images in any of the formats of Image.
+void FloatImage::read(const char* path)
+{
+    Image img(_name.c_str());
+    img.read(path);
+    *this = img;
+}
+
+bool FloatImage::write(const char* path)
+{
+    Image img(_name.c_str());
+    img = *this;
+    return img.write(path);
+}
+
+void FloatImage::save(const char* path)
+{
+    shared_ptr<FloatImage> copy = make_shared<FloatImage>(*this);
+    StartSave(path, [copy](const char* file) { return copy->write(file); });
+}
+
+ImageArray::ImageArray(const char* name) : _name(name)
+{}
+
+ImageArray::~ImageArray()
+{
+    resize(0);
+}
+
+int ImageArray::size()
+{
+    return (int)_images.size();
+}
+
+Image& ImageArray::operator[](int i)
+{
+    return *_images[i];
+}
+
+const string& ImageArray::name()
+{
+    return _name;
+}
+
+void ImageArray::resize(int count)
+{
+    while ((int)_images.size() > count)
+    {
+        delete _images.back();
+        _images.pop_back();
+    }
+
+    while ((int)_images.size() < count)
+    {
+        _images.push_back(new Image(_name.c_str()));
+    }
+}
+
+ImageArray& ImageArray::operator=(ImageArray& rhs)
+{
+	if (this == &rhs)
+	{
+	    return *this;
+	}
+
+    resize(rhs.size());
+    for (int i = 0; i < size(); ++i)
+    {
+        *_images[i] = rhs[i];
+    }
+
+    return *this;
+}
+
+// A path with wildcards is expanded in sorted order, any other path is a text file listing
+// one image per line.
+void ImageArray::read(const char* path)
+{
+    vector<string> files;
+
+    if (strpbrk(path, "*?[") != NULL)
+    {
+        glob_t matches;
+        if (glob(path, 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; ++i)
+            {
+                files.push_back(matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+    }
+    else
+    {
+        ifstream list(path);
+        if (!list)
+        {
+            cout << "Couldn't open: " << path << endl;
+            return;
+        }
+
+        string file;
+        while (getline(list, file))
+        {
+            if (!file.empty())
+            {
+                files.push_back(file);
+            }
+        }
+    }
+
+    resize(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        _images[i]->read(files[i].c_str());
+    }
+}
+
+// True if the pattern holds exactly one integer conversion, e.g. "%d" or "%05d" ("%%" being
+// a percent sign), so that IndexPath can format it with an index. Reports any other pattern.
+static bool IndexPattern(const char* pattern)
+{
+    int conversions = 0;
+    for (const char* c = pattern; *c != '\0'; ++c)
+    {
+        if ((*c != '%') || (*++c == '%'))
+        {
+            continue;
+        }
+
+        c += strspn(c, "-+ #0");
+        c += strspn(c, "0123456789");
+        if (*c == '.')
+        {
+            c += 1 + strspn(c + 1, "0123456789");
+        }
+        if ((*c != 'd') && (*c != 'i'))
+        {
+            conversions = 0;
+            break;
+        }
+        conversions++;
+    }
+
+    if (conversions != 1)
+    {
+        cout << "Error: " << pattern << " must hold one integer conversion, e.g. %d, for the index" << endl;
+        return false;
+    }
+    return true;
+}
+
+// The path of the given index from a pattern checked by IndexPattern.
+static string IndexPath(const char* pattern, int index)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), pattern, index);
+    return path;
+}
+
+// Image i is written to the path formatted from the pattern and i, e.g. "./out_%03d.bmp".
+void ImageArray::write(const char* pattern)
+{
+    if (!IndexPattern(pattern))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < _images.size(); ++i)
+    {
+        _images[i]->write(IndexPath(pattern, (int)i).c_str());
+    }
+}
+
+void ImageArray::save(const char* pattern)
+{
+    if (!IndexPattern(pattern))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < _images.size(); ++i)
+    {
+        _images[i]->save(IndexPath(pattern, (int)i).c_str());
+    }
+}
+
+Integral::Integral(const char* name) : _name(name),
+                                       _width(0),
+                                       _height(0),
+                                       _bytes(0)
+{}
+
+Integral::~Integral()
+{
+    Memory::Release(Memory::Host, _name, _bytes);
+}
+
+int Integral::width()
+{
+    return _width;
+}
+
+int Integral::height()
+{
+    return _height;
+}
+
+const string& Integral::name()
+{
+    return _name;
+}
+
+// Two passes on the thread pool: blocks of columns accumulate down their rows, reading the
+// contiguous BMP columns, then blocks of rows accumulate across their columns.
+void Integral::build(Image& img)
+{
+    static const size_t offsets[] = { offsetof(RGBApixel, Red), offsetof(RGBApixel, Green),
+                                      offsetof(RGBApixel, Blue) };
+    const size_t linesPerTask = 64;
+
+    _width  = img.width();
+    _height = img.height();
+    size_t stride = _width + 1;
+    size_t entries = stride * (_height + 1);
+
+    Memory::Release(Memory::Host, _name, _bytes);
+    _bytes = 6 * entries * sizeof(uint64_t);
+    Memory::Allocate(Memory::Host, _name, _bytes);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        _sums[c].assign(entries, 0);
+        _squares[c].assign(entries, 0);
+    }
+
+    ThreadPool::ParallelFor((_width + linesPerTask - 1) / linesPerTask, [&](size_t task)
+    {
+        int last = std::min((int)((task + 1) * linesPerTask), _width);
+        for (int col = (int)(task * linesPerTask); col < last; ++col)
+        {
+            const ebmpBYTE* column = (const ebmpBYTE*)img(0, col);
+            for (int c = 0; c < 3; ++c)
+            {
+                uint64_t* sums = &_sums[c][stride + col + 1];
+                uint64_t* squares = &_squares[c][stride + col + 1];
+                uint64_t sum = 0;
+                uint64_t square = 0;
+                for (int row = 0; row < _height; ++row)
+                {
+                    unsigned v = column[row * sizeof(RGBApixel) + offsets[c]];
+                    sum    += v;
+                    square += v * v;
+                    sums[row * stride]    = sum;
+                    squares[row * stride] = square;
+                }
+            }
+        }
+    });
+
+    ThreadPool::ParallelFor((_height + linesPerTask - 1) / linesPerTask, [&](size_t task)
+    {
+        int last = std::min((int)((task + 1) * linesPerTask), _height);
+        for (int row = (int)(task * linesPerTask); row < last; ++row)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                uint64_t* sums = &_sums[c][(row + 1) * stride];
+                uint64_t* squares = &_squares[c][(row + 1) * stride];
+                for (int col = 1; col <= _width; ++col)
+                {
+                    sums[col]    += sums[col - 1];
+                    squares[col] += squares[col - 1];
+                }
+            }
+        }
+    });
+}
+
+double Integral::Window(const vector<uint64_t>& table, int row, int col, int radius, double& count)
+{
+    int top    = std::max(row - radius, 0);
+    int left   = std::max(col - radius, 0);
+    int bottom = std::min(row + radius, _height - 1) + 1;
+    int right  = std::min(col + radius, _width - 1) + 1;
+    if ((top >= bottom) || (left >= right))
+    {
+        count = 0;
+        return 0.0;
+    }
+
+    size_t stride = _width + 1;
+    count = (double)(bottom - top) * (right - left);
+    return (double)(table[bottom * stride + right] - table[top * stride + right] -
+                    table[bottom * stride + left] + table[top * stride + left]);
+}
+
+double Integral::boxsum(Image::Channel channel, int row, int col, int radius)
+{
+    double count;
+    return Window(_sums[channel], row, col, radius, count);
+}
+
+double Integral::boxmean(Image::Channel channel, int row, int col, int radius)
+{
+    double count;
+    double sum = Window(_sums[channel], row, col, radius, count);
+    return (count > 0) ? sum / count : 0.0;
+}
+
+double Integral::boxvar(Image::Channel channel, int row, int col, int radius)
+{
+    double count;
+    double sum = Window(_sums[channel], row, col, radius, count);
+    double squares = Window(_squares[channel], row, col, radius, count);
+    if (count <= 0)
+    {
+        return 0.0;
+    }
+
+    double mean = sum / count;
+    double variance = squares / count - mean * mean;
+    return (variance > 0) ? variance : 0.0;
+}
+
+Stream::Stream(const char* name) : _name(name),
+                                   _depth(STREAM_DEPTH),
+                                   _reading(false),
+                                   _writing(false),
+                                   _stop(false)
+{
+    const char* depth = getenv("SIP_PREFETCH");
+    if ((depth != NULL) && (atoi(depth) > 0))
+    {
+        _depth = atoi(depth);
+    }
+}
+
+Stream::~Stream()
+{
+    close();
+}
+
+const string& Stream::name()
+{
+    return _name;
+}
+
+// A directory is read in the sorted order of its ".bmp" files, a path with wildcards in the
+// sorted order of its matches and a printf pattern from index 0, or 1, up to the first
+// missing frame.
+void Stream::read(const char* source)
+{
+    {
+        lock_guard<mutex> lock(_lock);
+        _stop = true;
+    }
+    _changed.notify_all();
+    if (_reader.joinable())
+    {
+        _reader.join();
+    }
+
+    for (size_t i = 0; i < _decoded.size(); ++i)
+    {
+        delete _decoded[i];
+    }
+    _decoded.clear();
+    _files.clear();
+
+    struct stat info;
+    if ((stat(source, &info) == 0) && S_ISDIR(info.st_mode))
+    {
+        string wildcard = string(source) + "/*.bmp";
+        glob_t matches;
+        if (glob(wildcard.c_str(), 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; ++i)
+            {
+                _files.push_back(matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+    }
+    else if (strpbrk(source, "*?[") != NULL)
+    {
+        glob_t matches;
+        if (glob(source, 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; ++i)
+            {
+                _files.push_back(matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+    }
+    else if (strchr(source, '%') != NULL)
+    {
+        bool valid = IndexPattern(source);
+        for (int index = 0; valid; ++index)
+        {
+            string path = IndexPath(source, index);
+            if (stat(path.c_str(), &info) != 0)
+            {
+                if ((index == 0) && (_files.empty()))
+                {
+                    continue;
+                }
+                break;
+            }
+            _files.push_back(path);
+        }
+    }
+    else
+    {
+        _files.push_back(source);
+    }
+
+    if (_files.empty())
+    {
+        cout << "No frames in: " << source << endl;
+    }
+
+    _stop    = false;
+    _reading = true;
+    _reader  = thread(&Stream::ReadAhead, this);
+}
+
+// Frames are numbered from 0 in the order they are pushed, e.g. "./out_%05d.bmp".
+void Stream::write(const char* pattern)
+{
+    {
+        lock_guard<mutex> lock(_lock);
+        _writing = false;
+    }
+    _changed.notify_all();
+    if (_writer.joinable())
+    {
+        _writer.join();
+    }
+
+    if (!IndexPattern(pattern))
+    {
+        return;
+    }
+
+    _pattern = pattern;
+    _writing = true;
+    _writer  = thread(&Stream::WriteBehind, this);
+}
+
+// Wait for the next frame, false once every frame has been taken.
+bool Stream::more()
+{
+    unique_lock<mutex> lock(_lock);
+    _changed.wait(lock, [this] { return !_decoded.empty() || !_reading; });
+    return !_decoded.empty();
+}
+
+void Stream::next(Image& img)
+{
+    unique_lock<mutex> lock(_lock);
+    _changed.wait(lock, [this] { return !_decoded.empty() || !_reading; });
+    if (_decoded.empty())
+    {
+        cout << "End of stream: " << _name << endl;
+        return;
+    }
+
+    Image* frame = _decoded.front();
+    _decoded.pop_front();
+    lock.unlock();
+    _changed.notify_all();
+
+    img = *frame;
+    delete frame;
+}
+
+// The frame is copied, so the image can be changed as soon as this returns. Blocks while
+// the writer is a full queue behind.
+void Stream::push(Image& img)
+{
+    Image* frame = new Image(_name.c_str());
+    *frame = img;
+
+    unique_lock<mutex> lock(_lock);
+    if (!_writing)
+    {
+        cout << "Stream isn't open for writing: " << _name << endl;
+        delete frame;
+        return;
+    }
+
+    _changed.wait(lock, [this] { return _pending.size() < _depth; });
+    _pending.push_back(frame);
+    lock.unlock();
+    _changed.notify_all();
+}
+
+// Stop decoding and wait until every pushed frame is written.
+void Stream::close()
+{
+    {
+        lock_guard<mutex> lock(_lock);
+        _stop    = true;
+        _writing = false;
+    }
+    _changed.notify_all();
+
+    if (_reader.joinable())
+    {
+        _reader.join();
+    }
+    if (_writer.joinable())
+    {
+        _writer.join();
+    }
+
+    for (size_t i = 0; i < _decoded.size(); ++i)
+    {
+        delete _decoded[i];
+    }
+    _decoded.clear();
+}
+
+void Stream::ReadAhead()
+{
+    for (size_t i = 0; i < _files.size(); ++i)
+    {
+        {
+            unique_lock<mutex> lock(_lock);
+            _changed.wait(lock, [this] { return _stop || (_decoded.size() < _depth); });
+            if (_stop)
+            {
+                break;
+            }
+        }
+
+        Image* frame = new Image(_name.c_str());
+        {
+            TraceScope scope("stream read", 0);
+            frame->read(_files[i].c_str());
+        }
+
+        {
+            lock_guard<mutex> lock(_lock);
+            _decoded.push_back(frame);
+        }
+        _changed.notify_all();
+    }
+
+    {
+        lock_guard<mutex> lock(_lock);
+        _reading = false;
+    }
+    _changed.notify_all();
+}
+
+// A frame stays in the queue while it is encoded, so that it counts against the depth.
+void Stream::WriteBehind()
+{
+    for (int index = 0; ; ++index)
+    {
+        Image* frame;
+        {
+            unique_lock<mutex> lock(_lock);
+            _changed.wait(lock, [this] { return !_pending.empty() || !_writing; });
+            if (_pending.empty())
+            {
+                break;
+            }
+            frame = _pending.front();
+        }
+
+        {
+            TraceScope scope("stream write", 0);
+            frame->write(IndexPath(_pattern.c_str(), index).c_str());
+        }
+
+        {
+            lock_guard<mutex> lock(_lock);
+            _pending.pop_front();
+        }
+        _changed.notify_all();
+        delete frame;
+    }
+}
+
+Memory::Usage::Usage() : liveTotal(0),
+                         peakTotal(0)
+{
+    memset(live, 0, sizeof(live));
+    memset(peak, 0, sizeof(peak));
+}
+
+Memory::State::State() : registered(false)
+{
+    // SIP_MEMORY=1 prints the live and peak bytes of every image at exit, with the images
+    // alive at the peak.
+    const char* memory = getenv("SIP_MEMORY");
+    reporting = (memory != NULL) && (strcmp(memory, "0") != 0);
+}
+
+Memory::State& Memory::Get()
+{
+    static State state;
+
+    // Registered once the state is constructed, so that the report runs before its destructor.
+    if (state.reporting && !state.registered)
+    {
+        state.registered = true;
+        atexit(Report);
+    }
+    return state;
+}
+
+void Memory::Allocate(Kind kind, const string& owner, size_t bytes)
+{
+    State& state = Get();
+    lock_guard<mutex> lock(state.lock);
+    Usage* usages[] = {&state.owners[owner], &state.total};
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        Usage& u = *usages[i];
+        u.live[kind] += bytes;
+        u.liveTotal  += bytes;
+        u.peak[kind] = (u.live[kind] > u.peak[kind]) ? u.live[kind] : u.peak[kind];
+        if (u.liveTotal > u.peakTotal)
+        {
+            u.peakTotal = u.liveTotal;
+
+            // A new peak of the total, remember who holds the memory.
+            if ((&u == &state.total) && state.reporting)
+            {
+                state.atPeak.clear();
+                for (map<string, Usage>::iterator it = state.owners.begin(); it != state.owners.end(); ++it)
+                {
+                    if (it->second.liveTotal > 0)
+                    {
+                        state.atPeak[it->first] = it->second.liveTotal;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Memory::Release(Kind kind, const string& owner, size_t bytes)
+{
+    State& state = Get();
+    lock_guard<mutex> lock(state.lock);
+    Usage* usages[] = {&state.owners[owner], &state.total};
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        Usage& u = *usages[i];
+        bytes = (bytes < u.live[kind]) ? bytes : u.live[kind];
+        u.live[kind] -= bytes;
+        u.liveTotal  -= bytes;
+    }
+}
+
+void Memory::Line(const char* name, const Usage& u)
+{
+    char text[256];
+    sprintf(text, "%-24s %10.1f %10.1f %10.1f %10.1f %10.1f", name, u.liveTotal / 1024.0,
+            u.peak[Host] / 1024.0, u.peak[Staging] / 1024.0, u.peak[Device] / 1024.0, u.peakTotal / 1024.0);
+    cerr << text << endl;
+}
+
+void Memory::Report()
+{
+    State& state = Get();
+
+    cerr << endl << "SIP memory (KB)" << endl;
+
+    char text[256];
+    sprintf(text, "%-24s %10s %10s %10s %10s %10s", "image", "live", "host", "staging", "device", "peak");
+    cerr << text << endl;
+
+    for (map<string, Usage>::iterator it = state.owners.begin(); it != state.owners.end(); ++it)
+    {
+        Line(it->first.c_str(), it->second);
+    }
+    Line("total", state.total);
+
+    cerr << endl << "Alive at the peak of " << state.total.peakTotal / 1024.0 << " KB:" << endl;
+    for (map<string, size_t>::iterator p = state.atPeak.begin(); p != state.atPeak.end(); ++p)
+    {
+        sprintf(text, "%-24s %10.1f", p->first.c_str(), p->second / 1024.0);
+        cerr << text << endl;
+    }
+}
+
+mutex                 Tracer::_lock;
+atomic<int>           Tracer::_threads(0);
+bool                  Tracer::_open = false;
+string                Tracer::_path;
+double                Tracer::_origin = 0.0;
+vector<Tracer::Event> Tracer::_events;
+size_t                Tracer::_dropped = 0;
+
+void Tracer::Open(const char* path)
+{
+    const char* file = getenv("SIP_TRACE_FILE");
+
+    _path   = (file != NULL) ? file : path;
+    _origin = Now();
+
+    if (!_open)
+    {
+        _open = true;
+        atexit(Write);
+    }
+}
+
+double Tracer::Now()
+{
+    return ::Now();
+}
+
+void Tracer::Record(const char* name, int line, double start, double end)
+{
+    if (!_open)
+    {
+        return;
+    }
+
+    lock_guard<mutex> lock(_lock);
+    if (_events.size() >= MAX_TRACE_EVENTS)
+    {
+        _dropped++;
+        return;
+    }
+
+    static thread_local int thread = ++_threads;
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    Event event;
+    event.name   = name;
+    event.line   = line;
+    event.start  = start;
+    event.end    = end;
+#ifdef __APPLE__
+    event.maxRss = usage.ru_maxrss / 1024;
+#else
+    event.maxRss = usage.ru_maxrss;
+#endif
+    event.thread = thread;
+    _events.push_back(event);
+}
+
+// The text as the contents of a JSON string, with quotes, backslashes and control characters escaped.
+static string JsonEscape(const char* text)
+{
+    string escaped;
+    for (const char* c = text; *c != '\0'; ++c)
+    {
+        if ((*c == '"') || (*c == '\\'))
+        {
+            escaped += '\\';
+            escaped += *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)*c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+// One complete ("X") event per line, timestamps in microseconds from Open.
+void Tracer::Write()
+{
+    FILE* file = fopen(_path.c_str(), "w");
+    if (!file)
+    {
+        cout << "Couldn't open: " << _path << endl;
+        return;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < _events.size(); ++i)
+    {
+        Event& e = _events[i];
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"sip\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":1,\"tid\":%d,\"args\":{\"line\":%d,\"maxrss_kb\":%ld}}%s\n",
+                JsonEscape(e.name).c_str(), (e.start - _origin) * 1e6, (e.end - e.start) * 1e6, e.thread, e.line, e.maxRss,
+                (i + 1 < _events.size()) ? "," : "");
+    }
+    fprintf(file, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu}}\n", (unsigned long)_dropped);
+
+    fclose(file);
+}
+
+TraceScope::TraceScope(const char* name, int line) : _name(name),
+                                                     _line(line),
+                                                     _start(Tracer::Now())
+{}
+
+TraceScope::~TraceScope()
+{
+    Tracer::Record(_name, _line, _start, Tracer::Now());
+}
+
+// Set on the workers of the pool and on the thread running a parfor, nested ones run inline.
+static thread_local bool t_inParallel = false;
+
+ThreadPool& ThreadPool::Get()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool() : _body(NULL),
+                           _generation(0),
+                           _running(0),
+                           _stop(false),
+                           _ioStop(false)
+{
+    // One worker per hardware thread unless SIP_THREADS is set.
+    size_t count = thread::hardware_concurrency();
+
+    const char* threads = getenv("SIP_THREADS");
+    if (threads != NULL)
+    {
+        count = strtoul(threads, NULL, 10);
+    }
+
+    count = (count > 0) ? count : 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        _ranges.push_back(new Range());
+        _ranges[i]->begin = 0;
+        _ranges[i]->end   = 0;
+    }
+
+    for (size_t i = 1; i < count; ++i)
+    {
+        _threads.push_back(thread(&ThreadPool::Work, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(_ioLock);
+        _ioStop = true;
+        _tasks.clear();
+    }
+    _queued.notify_all();
+
+    for (size_t i = 0; i < _io.size(); ++i)
+    {
+        _io[i].join();
+    }
+
+    {
+        lock_guard<mutex> lock(_lock);
+        _stop = true;
+    }
+    _start.notify_all();
+
+    for (size_t i = 0; i < _threads.size(); ++i)
+    {
+        _threads[i].join();
+    }
+
+    for (size_t i = 0; i < _ranges.size(); ++i)
+    {
+        delete _ranges[i];
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const function<void(size_t)>& body)
+{
+    if (t_inParallel || (count < 2))
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            body(i);
+        }
+        return;
+    }
+
+    Get().Run(count, body);
+}
+
+void ThreadPool::Run(size_t count, const function<void(size_t)>& body)
+{
+    unique_lock<mutex> submit(_submit, try_to_lock);
+    if (!submit.owns_lock())
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            body(i);
+        }
+        return;
+    }
+
+    size_t workers = _ranges.size();
+    for (size_t i = 0; i < workers; ++i)
+    {
+        lock_guard<mutex> lock(_ranges[i]->lock);
+        _ranges[i]->begin = count * i / workers;
+        _ranges[i]->end   = count * (i + 1) / workers;
+    }
+
+    {
+        lock_guard<mutex> lock(_lock);
+        _body    = &body;
+        _running = workers - 1;
+        _generation++;
+    }
+    _start.notify_all();
+
+    t_inParallel = true;
+    Drain(0);
+    t_inParallel = false;
+
+    unique_lock<mutex> lock(_lock);
+    while (_running > 0)
+    {
+        _done.wait(lock);
+    }
+    _body = NULL;
+}
+
+void ThreadPool::Work(size_t worker)
+{
+    t_inParallel = true;
+
+    size_t generation = 0;
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(_lock);
+            while (!_stop && (_generation == generation))
+            {
+                _start.wait(lock);
+            }
+
+            if (_stop)
+            {
+                return;
+            }
+            generation = _generation;
+        }
+
+        Drain(worker);
+
+        lock_guard<mutex> lock(_lock);
+        if (--_running == 0)
+        {
+            _done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::Background(const function<void()>& task)
+{
+    ThreadPool& pool = Get();
+    {
+        lock_guard<mutex> lock(pool._ioLock);
+        if (pool._io.empty())
+        {
+            for (size_t i = 0; i < IO_THREADS; ++i)
+            {
+                pool._io.push_back(thread(&ThreadPool::Serve, &pool));
+            }
+        }
+        pool._tasks.push_back(task);
+    }
+    pool._queued.notify_one();
+}
+
+void ThreadPool::Serve()
+{
+    for (;;)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(_ioLock);
+            _queued.wait(lock, [this] { return _ioStop || !_tasks.empty(); });
+            if (_ioStop)
+            {
+                return;
+            }
+            task = _tasks.front();
+            _tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+void ThreadPool::Drain(size_t worker)
+{
+    size_t index = 0;
+    while (Next(worker, index))
+    {
+        (*_body)(index);
+    }
+}
+
+bool ThreadPool::Next(size_t worker, size_t& index)
+{
+    Range& own = *_ranges[worker];
+    {
+        lock_guard<mutex> lock(own.lock);
+        if (own.begin < own.end)
+        {
+            index = own.begin++;
+            return true;
+        }
+    }
+
+    for (;;)
+    {
+        size_t victim = worker;
+        size_t most = 0;
+        for (size_t i = 0; i < _ranges.size(); ++i)
+        {
+            lock_guard<mutex> lock(_ranges[i]->lock);
+            size_t left = _ranges[i]->end - _ranges[i]->begin;
+            if (left > most)
+            {
+                most   = left;
+                victim = i;
+            }
+        }
+
+        if (most == 0)
+        {
+            return false;
+        }
+
+        size_t begin = 0;
+        size_t end = 0;
+        {
+            Range& other = *_ranges[victim];
+            lock_guard<mutex> lock(other.lock);
+            if (other.begin >= other.end)
+            {
+                continue; // Emptied by its owner meanwhile
+            }
+
+            end = other.end;
+            begin = other.end - (other.end - other.begin + 1) / 2;
+            other.end = begin;
+        }
+
+        lock_guard<mutex> lock(own.lock);
+        own.begin = begin + 1;
+        own.end   = end;
+        index     = begin;
+        return true;
+    }
+}
+
+Histogram::Histogram()
+{
+    memset((void*)_red, 0, sizeof(_red));
+    memset((void*)_green, 0, sizeof(_green));
+    memset((void*)_blue, 0, sizeof(_blue));
+}
+
+Histogram::Histogram(Image& img)
 {
     memset((void*)_red, 0, sizeof(_red));
     memset((void*)_green, 0, sizeof(_green));
@@ -491,6 +4128,23 @@ Histogram::Histogram(Image& img)
     }
 }
 
+Histogram::Histogram(Gray& img)
+{
+    memset((void*)_red, 0, sizeof(_red));
+
+    for (int col = 0; col < img.width(); ++col)
+    {
+        const GrayPixel* column = img(0, col);
+        for (int row = 0; row < img.height(); ++row)
+        {
+            _red[column[row].Luma]++;
+        }
+    }
+
+    memcpy((void*)_green, _red, sizeof(_red));
+    memcpy((void*)_blue, _red, sizeof(_red));
+}
+
 unsigned int Histogram::operator()(int bin, int color)
 {
     if ((bin < 0) || (bin >= 256) || (color < 0) || (color > 2))
@@ -3,6 +3,7 @@ __constant sampler_t sampler =  CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_
 __kernel void image_copy(__read_only image2d_t in_image, __write_only image2d_t out_image)
 {
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
     float4 sum = (float4)(0.0f);
 
     for (int y = -3; y <= 3; y++) 
@@ -19,6 +20,7 @@ __kernel void image_copy(__read_only image2d_t in_image, __write_only image2d_t
 __kernel void apply_filter(__read_only image2d_t in_image, __write_only image2d_t out_image, __constant float* filter)
 {
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(out_image) || pos.y >= get_image_height(out_image)) return;
 
     float4 sum = (float4)(0.0f);
     for (int y = -1; y <= 1; y++)